@@ -0,0 +1,371 @@
+/*
+ * Copyright 2015, 2016 Andrew Ayer <agwa@andrewayer.name>
+ * Copyright 2016-2020 Chris Lamb <lamby@debian.org>
+ *
+ * This file is part of disorderfs.
+ *
+ * disorderfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * disorderfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with disorderfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * disorderfs-bench: measures one filesystem workload and prints the result
+ * as a single line of JSON, so that bench/run can compare disorderfs against
+ * the underlying filesystem and results can be trended across releases.
+ *
+ * Usage: disorderfs-bench [-l KEY=VALUE]... WORKLOAD ARGS...
+ *
+ *   readdir DIR REPEAT                     open and list DIR REPEAT times
+ *   stat DIR REPEAT                        lstat every entry of DIR REPEAT times
+ *   walk DIR REPEAT                        lstat every file under DIR REPEAT times
+ *   read FILE seq|rand BLOCKSIZE BYTES     read BYTES from FILE
+ *   write FILE seq|rand BLOCKSIZE BYTES    write BYTES to FILE
+ *   lock FILE fcntl|flock PROCS REPEAT     PROCS processes each lock and
+ *                                          unlock FILE REPEAT times
+ *   startup DISORDERFS ROOTDIR MOUNTPOINT REPEAT
+ *                                          mount, stat MOUNTPOINT and unmount
+ *                                          REPEAT times
+ *
+ * Every -l KEY=VALUE is copied into the output as a string field.
+ */
+
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <random>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+namespace {
+std::vector<std::pair<std::string, std::string>>        labels;
+
+void perror_and_die (const char* s)
+{
+    std::perror(s);
+    std::exit(1);
+}
+
+double now ()
+{
+    struct timespec                ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void print_result (const char* workload, uint64_t ops, uint64_t bytes, double seconds,
+                   const std::vector<std::pair<const char*, double>>& extra = {})
+{
+    std::cout << "{\"workload\":\"" << workload << "\"";
+    for (const auto& label : labels) {
+        std::cout << ",\"" << label.first << "\":\"" << label.second << "\"";
+    }
+    std::cout << ",\"ops\":" << ops << ",\"seconds\":" << seconds
+              << ",\"ops_per_sec\":" << (seconds > 0 ? ops / seconds : 0);
+    if (bytes > 0) {
+        std::cout << ",\"bytes\":" << bytes << ",\"bytes_per_sec\":" << (seconds > 0 ? bytes / seconds : 0);
+    }
+    for (const auto& field : extra) {
+        std::cout << ",\"" << field.first << "\":" << field.second;
+    }
+    std::cout << "}" << std::endl;
+}
+
+std::vector<std::string> list (const char* dir)
+{
+    std::vector<std::string>        names;
+    DIR*                        d = opendir(dir);
+    if (!d) {
+        perror_and_die(dir);
+    }
+    while (struct dirent* dirent_p = readdir(d)) {
+        names.emplace_back(dirent_p->d_name);
+    }
+    closedir(d);
+    return names;
+}
+
+int bench_readdir (const char* dir, int repeat)
+{
+    uint64_t                        entries = 0;
+    double                        first_entry = 0;
+    const double                start = now();
+    for (int i = 0; i < repeat; ++i) {
+        const double                open_time = now();
+        DIR*                        d = opendir(dir);
+        if (!d) {
+            perror_and_die(dir);
+        }
+        bool                        first = true;
+        while (readdir(d)) {
+            if (first) {
+                first_entry += now() - open_time;
+                first = false;
+            }
+            ++entries;
+        }
+        closedir(d);
+    }
+    print_result("readdir", entries, 0, now() - start, {{"first_entry_seconds", first_entry / repeat}});
+    return 0;
+}
+
+int bench_stat (const char* dir, int repeat)
+{
+    const std::vector<std::string>        names(list(dir));
+    const int                        dirfd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (dirfd == -1) {
+        perror_and_die(dir);
+    }
+    uint64_t                        ops = 0;
+    const double                start = now();
+    for (int i = 0; i < repeat; ++i) {
+        for (const auto& name : names) {
+            struct stat        st;
+            if (fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                perror_and_die(name.c_str());
+            }
+            ++ops;
+        }
+    }
+    print_result("stat", ops, 0, now() - start);
+    close(dirfd);
+    return 0;
+}
+
+uint64_t        walk_entries;
+int count_entry (const char*, const struct stat*, int, struct FTW*)
+{
+    ++walk_entries;
+    return 0;
+}
+
+int bench_walk (const char* dir, int repeat)
+{
+    const double                start = now();
+    for (int i = 0; i < repeat; ++i) {
+        if (nftw(dir, count_entry, 64, FTW_PHYS) == -1) {
+            perror_and_die(dir);
+        }
+    }
+    print_result("walk", walk_entries, 0, now() - start);
+    return 0;
+}
+
+int bench_io (bool writing, const char* file, bool random, size_t block_size, uint64_t total)
+{
+    const int                        fd = open(file, writing ? O_WRONLY | O_CREAT : O_RDONLY, 0644);
+    if (fd == -1) {
+        perror_and_die(file);
+    }
+    uint64_t                        file_size = total;
+    if (!writing) {
+        struct stat                st;
+        fstat(fd, &st);
+        file_size = st.st_size;
+    }
+    const uint64_t                blocks = file_size / block_size;
+    if (blocks == 0) {
+        std::cerr << "disorderfs-bench: " << file << " is smaller than one block" << std::endl;
+        return 1;
+    }
+    std::vector<char>                buf(block_size, 'x');
+    std::mt19937_64                rng(42);
+    uint64_t                        ops = 0;
+    uint64_t                        bytes = 0;
+    const double                start = now();
+    while (bytes < total) {
+        const off_t                off = (random ? rng() % blocks : ops % blocks) * block_size;
+        const ssize_t                res = writing ? pwrite(fd, buf.data(), block_size, off) : pread(fd, buf.data(), block_size, off);
+        if (res <= 0) {
+            perror_and_die(writing ? "pwrite" : "pread");
+        }
+        bytes += res;
+        ++ops;
+    }
+    if (writing && fsync(fd) == -1) {
+        perror_and_die("fsync");
+    }
+    print_result(writing ? "write" : "read", ops, bytes, now() - start);
+    close(fd);
+    return 0;
+}
+
+// Every process opens FILE itself, so that both kinds of lock conflict
+void lock_loop (const char* file, bool posix, int repeat)
+{
+    const int                        fd = open(file, O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        perror_and_die(file);
+    }
+    struct flock                lock{};
+    lock.l_whence = SEEK_SET;
+    for (int i = 0; i < repeat; ++i) {
+        lock.l_type = F_WRLCK;
+        if (posix ? fcntl(fd, F_SETLKW, &lock) : flock(fd, LOCK_EX)) {
+            perror_and_die("lock");
+        }
+        lock.l_type = F_UNLCK;
+        if (posix ? fcntl(fd, F_SETLK, &lock) : flock(fd, LOCK_UN)) {
+            perror_and_die("unlock");
+        }
+    }
+    close(fd);
+}
+
+int bench_lock (const char* file, bool posix, int procs, int repeat)
+{
+    const double                start = now();
+    for (int i = 0; i < procs; ++i) {
+        const pid_t                pid = fork();
+        if (pid == -1) {
+            perror_and_die("fork");
+        } else if (pid == 0) {
+            lock_loop(file, posix, repeat);
+            std::_Exit(0);
+        }
+    }
+    int                                failures = 0;
+    int                                status;
+    while (wait(&status) != -1) {
+        failures += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    if (failures) {
+        std::cerr << "disorderfs-bench: " << failures << " locking processes failed" << std::endl;
+        return 1;
+    }
+    print_result(posix ? "lock_fcntl" : "lock_flock", uint64_t(procs) * repeat, 0, now() - start);
+    return 0;
+}
+
+// Starts argv, with ready_fd (if any) as its fd 3
+pid_t spawn (const char* const* argv, int ready_fd = -1)
+{
+    const pid_t                        pid = fork();
+    if (pid == -1) {
+        perror_and_die("fork");
+    } else if (pid == 0) {
+        if (ready_fd != -1 && ready_fd != 3) {
+            dup2(ready_fd, 3);
+            close(ready_fd);
+        }
+        execvp(argv[0], const_cast<char* const*>(argv));
+        std::perror(argv[0]);
+        std::_Exit(127);
+    }
+    return pid;
+}
+
+// The exit status of pid, or -1 if it didn't exit normally
+int wait_for (pid_t pid)
+{
+    int                                status;
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+// From starting disorderfs to --ready-fd firing, and to the first request
+// through the mount being answered
+int bench_startup (const char* disorderfs, const char* root, const char* mountpoint, int repeat)
+{
+    double                        ready = 0;
+    double                        first_request = 0;
+    const double                start = now();
+    for (int i = 0; i < repeat; ++i) {
+        int                        fds[2];
+        if (pipe(fds) == -1) {
+            perror_and_die("pipe");
+        }
+        // In the foreground, disorderfs stays our child until unmounted
+        const char* const        argv[] = {disorderfs, "-q", "-f", "--ready-fd=3", root, mountpoint, nullptr};
+        const double                launch = now();
+        const pid_t                pid = spawn(argv, fds[1]);
+        close(fds[1]);
+        char                        c;
+        const ssize_t                res = read(fds[0], &c, 1);
+        close(fds[0]);
+        if (res != 1) {
+            std::cerr << "disorderfs-bench: " << disorderfs << " never became ready" << std::endl;
+            wait_for(pid);
+            return 1;
+        }
+        ready += now() - launch;
+        struct stat                st;
+        if (stat(mountpoint, &st) == -1) {
+            perror_and_die(mountpoint);
+        }
+        first_request += now() - launch;
+
+        const char* const        unmount[] = {"fusermount", "-u", mountpoint, nullptr};
+        if (wait_for(spawn(unmount)) != 0) {
+            std::cerr << "disorderfs-bench: cannot unmount " << mountpoint << std::endl;
+            return 1;
+        }
+        wait_for(pid);
+    }
+    print_result("startup", repeat, 0, now() - start,
+                 {{"ready_seconds", ready / repeat}, {"first_request_seconds", first_request / repeat}});
+    return 0;
+}
+
+void usage ()
+{
+    std::clog << "Usage: disorderfs-bench [-l KEY=VALUE]... readdir|stat|walk DIR REPEAT" << std::endl;
+    std::clog << "       disorderfs-bench [-l KEY=VALUE]... read|write FILE seq|rand BLOCKSIZE BYTES" << std::endl;
+    std::clog << "       disorderfs-bench [-l KEY=VALUE]... lock FILE fcntl|flock PROCS REPEAT" << std::endl;
+    std::clog << "       disorderfs-bench [-l KEY=VALUE]... startup DISORDERFS ROOTDIR MOUNTPOINT REPEAT" << std::endl;
+    std::exit(2);
+}
+}
+
+int        main (int argc, char** argv)
+{
+    int                                opt;
+    while ((opt = getopt(argc, argv, "l:")) != -1) {
+        const char*                eq = opt == 'l' ? std::strchr(optarg, '=') : nullptr;
+        if (!eq) {
+            usage();
+        }
+        labels.emplace_back(std::string(optarg, eq - optarg), eq + 1);
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc == 3 && std::strcmp(argv[0], "readdir") == 0) {
+        return bench_readdir(argv[1], std::atoi(argv[2]));
+    } else if (argc == 3 && std::strcmp(argv[0], "stat") == 0) {
+        return bench_stat(argv[1], std::atoi(argv[2]));
+    } else if (argc == 3 && std::strcmp(argv[0], "walk") == 0) {
+        return bench_walk(argv[1], std::atoi(argv[2]));
+    } else if (argc == 5 && (std::strcmp(argv[0], "read") == 0 || std::strcmp(argv[0], "write") == 0)) {
+        return bench_io(argv[0][0] == 'w', argv[1], std::strcmp(argv[2], "rand") == 0,
+                        std::strtoull(argv[3], nullptr, 0), std::strtoull(argv[4], nullptr, 0));
+    } else if (argc == 5 && std::strcmp(argv[0], "lock") == 0) {
+        return bench_lock(argv[1], std::strcmp(argv[2], "flock") != 0, std::atoi(argv[3]), std::atoi(argv[4]));
+    } else if (argc == 5 && std::strcmp(argv[0], "startup") == 0) {
+        return bench_startup(argv[1], argv[2], argv[3], std::atoi(argv[4]));
+    }
+    usage();
+}
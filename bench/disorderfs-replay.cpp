@@ -0,0 +1,355 @@
+/*
+ * Copyright 2015, 2016 Andrew Ayer <agwa@andrewayer.name>
+ * Copyright 2016-2020 Chris Lamb <lamby@debian.org>
+ *
+ * This file is part of disorderfs.
+ *
+ * disorderfs is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * disorderfs is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with disorderfs.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * disorderfs-replay: repeats the operations that disorderfs --record=FILE
+ * logged against a mount, and prints throughput and latency percentiles as
+ * a single line of JSON, like disorderfs-bench.
+ *
+ * Usage: disorderfs-replay [-l KEY=VALUE]... [-t] TRACE MOUNTPOINT
+ *
+ *   -l KEY=VALUE   copy KEY=VALUE into the output as a string field
+ *   -t             keep the original timing, instead of going as fast as
+ *                  possible
+ *
+ * Operations are replayed one at a time, in the order they completed, from
+ * a single thread.  Open files and directories are tracked by the handle
+ * they were recorded with.  Listing a directory is replayed when the
+ * trace reads it from the start, and the later readdir calls that
+ * continued the listing are counted as skipped, as are lock and flock.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <ctime>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <unordered_map>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/xattr.h>
+
+namespace {
+std::vector<std::pair<std::string, std::string>>        labels;
+
+struct Record {
+    uint64_t                        time_ns;
+    std::string                        operation;
+    int                                result;
+    std::string                        path;                // empty for an open file
+    std::string                        path2;
+    uint64_t                        size;
+    int64_t                        offset;
+    uint64_t                        fh;
+    int                                flags;
+    unsigned int                mode;
+};
+
+double now ()
+{
+    struct timespec                ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Undoes the escaping disorderfs applies to the path fields
+std::string unescape (const std::string& field)
+{
+    if (field == "-") {
+        return "";
+    }
+    std::string                        out;
+    for (size_t i = 0; i < field.size(); ++i) {
+        if (field[i] == '\\' && i + 1 < field.size()) {
+            const char                c = field[++i];
+            out += c == 't' ? '\t' : c == 'n' ? '\n' : c;
+        } else {
+            out += field[i];
+        }
+    }
+    return out;
+}
+
+bool parse (const std::string& line, Record& record)
+{
+    std::vector<std::string>        fields;
+    size_t                        start = 0;
+    for (;;) {
+        const size_t                tab = line.find('\t', start);
+        fields.push_back(line.substr(start, tab - start));
+        if (tab == std::string::npos) {
+            break;
+        }
+        start = tab + 1;
+    }
+    if (fields.size() != 12) {
+        return false;
+    }
+    record.time_ns = std::strtoull(fields[0].c_str(), nullptr, 10);
+    record.operation = fields[2];
+    record.result = std::atoi(fields[3].c_str());
+    record.path = unescape(fields[5]);
+    record.path2 = unescape(fields[6]);
+    record.size = std::strtoull(fields[7].c_str(), nullptr, 10);
+    record.offset = static_cast<int64_t>(std::strtoull(fields[8].c_str(), nullptr, 10));
+    record.fh = std::strtoull(fields[9].c_str(), nullptr, 10);
+    record.flags = std::atoi(fields[10].c_str());
+    record.mode = std::strtoul(fields[11].c_str(), nullptr, 10);
+    return true;
+}
+
+class Replayer {
+    const std::string                        mountpoint;
+    std::unordered_map<uint64_t, int>        files;                // recorded fh -> our fd
+    std::unordered_map<uint64_t, DIR*>        dirs;
+    std::vector<char>                        buffer;
+
+    std::string path (const std::string& p) const { return mountpoint + p; }
+
+    int file (uint64_t fh) const
+    {
+        const auto                        it = files.find(fh);
+        return it == files.end() ? -1 : it->second;
+    }
+    DIR* dir (uint64_t fh) const
+    {
+        const auto                        it = dirs.find(fh);
+        return it == dirs.end() ? nullptr : it->second;
+    }
+    char* buf (size_t size)
+    {
+        if (buffer.size() < size) {
+            buffer.resize(size);
+        }
+        return buffer.data();
+    }
+
+    static int result (long res) { return res == -1 ? -errno : static_cast<int>(res); }
+
+public:
+    explicit Replayer (const std::string& mountpoint) : mountpoint(mountpoint) { }
+    ~Replayer ()
+    {
+        for (const auto& f : files) {
+            close(f.second);
+        }
+        for (const auto& d : dirs) {
+            closedir(d.second);
+        }
+    }
+
+    // Does the operation, and returns its result (-errno on failure), or
+    // sets skipped if it isn't one to replay
+    int replay (const Record& r, bool& skipped)
+    {
+        skipped = false;
+        const std::string        p = path(r.path);
+        const std::string&        op = r.operation;
+        struct stat                st;
+        if (op == "getattr") {
+            return result(lstat(p.c_str(), &st));
+        } else if (op == "fgetattr") {
+            return result(fstat(file(r.fh), &st));
+        } else if (op == "readlink") {
+            return result(readlink(p.c_str(), buf(r.size), r.size));
+        } else if (op == "mknod") {
+            return result(mknod(p.c_str(), r.mode, 0));
+        } else if (op == "mkdir") {
+            return result(mkdir(p.c_str(), r.mode));
+        } else if (op == "unlink") {
+            return result(unlink(p.c_str()));
+        } else if (op == "rmdir") {
+            return result(rmdir(p.c_str()));
+        } else if (op == "symlink") {
+            return result(symlink(r.path2.c_str(), p.c_str()));
+        } else if (op == "rename") {
+            return result(rename(p.c_str(), path(r.path2).c_str()));
+        } else if (op == "link") {
+            return result(link(p.c_str(), path(r.path2).c_str()));
+        } else if (op == "chmod") {
+            return result(chmod(p.c_str(), r.mode));
+        } else if (op == "chown") {
+            return result(lchown(p.c_str(), -1, -1));
+        } else if (op == "truncate") {
+            return result(truncate(p.c_str(), r.offset));
+        } else if (op == "ftruncate") {
+            return result(ftruncate(file(r.fh), r.offset));
+        } else if (op == "open" || op == "create") {
+            const int                fd = op == "open" ? open(p.c_str(), r.flags & ~(O_CREAT | O_EXCL))
+                                                  : open(p.c_str(), r.flags | O_CREAT, r.mode);
+            if (fd != -1) {
+                files[r.fh] = fd;
+            }
+            return result(fd == -1 ? -1 : 0);
+        } else if (op == "read" || op == "read_buf") {
+            return result(pread(file(r.fh), buf(r.size), r.size, r.offset));
+        } else if (op == "write" || op == "write_buf") {
+            return result(pwrite(file(r.fh), buf(r.size), r.size, r.offset));
+        } else if (op == "statfs") {
+            struct statvfs        sv;
+            return result(statvfs(p.c_str(), &sv));
+        } else if (op == "flush") {
+            return result(close(dup(file(r.fh))));
+        } else if (op == "release") {
+            const int                res = close(file(r.fh));
+            files.erase(r.fh);
+            return result(res);
+        } else if (op == "fsync") {
+            return result(fsync(file(r.fh)));
+        } else if (op == "setxattr") {
+            return result(lsetxattr(p.c_str(), r.path2.c_str(), buf(r.size), r.size, r.flags));
+        } else if (op == "getxattr") {
+            return result(lgetxattr(p.c_str(), r.path2.c_str(), buf(r.size), r.size));
+        } else if (op == "listxattr") {
+            return result(llistxattr(p.c_str(), buf(r.size), r.size));
+        } else if (op == "removexattr") {
+            return result(lremovexattr(p.c_str(), r.path2.c_str()));
+        } else if (op == "opendir") {
+            DIR*                d = opendir(p.c_str());
+            if (d) {
+                dirs[r.fh] = d;
+            }
+            return result(d ? 0 : -1);
+        } else if (op == "readdir") {
+            DIR*                d = dir(r.fh);
+            if (r.offset != 0 || !d) {
+                skipped = d != nullptr;
+                return d ? 0 : -EBADF;
+            }
+            rewinddir(d);
+            errno = 0;
+            while (readdir(d)) { }
+            return -errno;
+        } else if (op == "releasedir") {
+            DIR*                d = dir(r.fh);
+            dirs.erase(r.fh);
+            return d ? result(closedir(d)) : -EBADF;
+        } else if (op == "fsyncdir") {
+            DIR*                d = dir(r.fh);
+            return d ? result(fsync(dirfd(d))) : -EBADF;
+        } else if (op == "utimens") {
+            return result(utimensat(AT_FDCWD, p.c_str(), nullptr, AT_SYMLINK_NOFOLLOW));
+        } else if (op == "fallocate") {
+            return result(fallocate(file(r.fh), r.mode, r.offset, r.size));
+        }
+        skipped = true; // lock, flock, and anything newer than us
+        return 0;
+    }
+};
+
+void usage ()
+{
+    std::clog << "Usage: disorderfs-replay [-l KEY=VALUE]... [-t] TRACE MOUNTPOINT" << std::endl;
+    std::exit(2);
+}
+}
+
+int        main (int argc, char** argv)
+{
+    bool                        original_timing = false;
+    int                                opt;
+    while ((opt = getopt(argc, argv, "l:t")) != -1) {
+        if (opt == 't') {
+            original_timing = true;
+            continue;
+        }
+        const char*                eq = opt == 'l' ? std::strchr(optarg, '=') : nullptr;
+        if (!eq) {
+            usage();
+        }
+        labels.emplace_back(std::string(optarg, eq - optarg), eq + 1);
+    }
+    if (argc - optind != 2) {
+        usage();
+    }
+    const char*                        trace = argv[optind];
+
+    std::ifstream                file(trace);
+    if (!file) {
+        std::perror(trace);
+        return 1;
+    }
+    std::vector<Record>                records;
+    std::string                        line;
+    for (int lineno = 1; std::getline(file, line); ++lineno) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        records.emplace_back();
+        if (!parse(line, records.back())) {
+            std::cerr << "disorderfs-replay: " << trace << ": line " << lineno << ": malformed" << std::endl;
+            return 1;
+        }
+    }
+
+    Replayer                        replayer(argv[optind + 1]);
+    std::vector<uint64_t>        latencies;
+    latencies.reserve(records.size());
+    uint64_t                        skipped = 0;
+    uint64_t                        errors = 0;
+    uint64_t                        mismatches = 0;
+    const double                start = now();
+    for (const Record& record : records) {
+        if (original_timing) {
+            const double        due = start + (record.time_ns - records.front().time_ns) / 1e9;
+            const double        wait = due - now();
+            if (wait > 0) {
+                usleep(static_cast<useconds_t>(wait * 1e6));
+            }
+        }
+        bool                        was_skipped;
+        const double                op_start = now();
+        const int                res = replayer.replay(record, was_skipped);
+        const double                op_end = now();
+        if (was_skipped) {
+            ++skipped;
+            continue;
+        }
+        latencies.push_back(static_cast<uint64_t>((op_end - op_start) * 1e9));
+        errors += res < 0;
+        mismatches += (res < 0) != (record.result < 0);
+    }
+    const double                seconds = now() - start;
+
+    std::sort(latencies.begin(), latencies.end());
+    const auto percentile = [&latencies] (double q) -> uint64_t {
+        return latencies.empty() ? 0 : latencies[std::min(latencies.size() - 1, static_cast<size_t>(q * latencies.size()))];
+    };
+    std::cout << "{\"workload\":\"replay\"";
+    for (const auto& label : labels) {
+        std::cout << ",\"" << label.first << "\":\"" << label.second << "\"";
+    }
+    std::cout << ",\"ops\":" << latencies.size() << ",\"seconds\":" << seconds
+              << ",\"ops_per_sec\":" << (seconds > 0 ? latencies.size() / seconds : 0)
+              << ",\"skipped\":" << skipped << ",\"errors\":" << errors << ",\"mismatches\":" << mismatches
+              << ",\"p50_ns\":" << percentile(0.5) << ",\"p90_ns\":" << percentile(0.9)
+              << ",\"p99_ns\":" << percentile(0.99) << ",\"max_ns\":" << (latencies.empty() ? 0 : latencies.back())
+              << "}" << std::endl;
+    return 0;
+}
@@ -23,11 +23,17 @@
 #include <cstring>
 #include <string>
 #include <fstream>
+#if FUSE_USE_VERSION >= 30
+#include <fuse_lowlevel.h>
+#if FUSE_VERSION < FUSE_MAKE_VERSION(3, 8)
+#error "the FUSE 3 backend needs libfuse 3.8 or later"
+#endif
+#else
 #include <fuse.h>
-extern "C" {
-#include <ulockmgr.h>
-}
+#include <fuse_lowlevel.h>
+#endif
 #include <dirent.h>
+#include <fnmatch.h>
 #include <iostream>
 #include <memory>
 #include <signal.h>
@@ -37,29 +43,88 @@ extern "C" {
 #include <vector>
 #include <random>
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <unordered_map>
 #include <sys/xattr.h>
+#include <linux/limits.h>
 #include <sys/types.h>
 #include <sys/syscall.h>
 #include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <cstdio>
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+#else
+#define DTRACE_PROBE1(provider, name, arg1)
+#define DTRACE_PROBE2(provider, name, arg1, arg2)
+#define DTRACE_PROBE3(provider, name, arg1, arg2, arg3)
+#endif
 
 #define DISORDERFS_VERSION "0.5.12"
 
 namespace {
 std::vector<std::string>        bare_arguments;
-std::string                        root;
+std::string                        stats_file;
+std::string                        trace_file;
+std::string                        record_file;
+std::string                        policy_file;
+std::string                        mounts_file;
+enum {
+    CACHE_STRICT,
+    CACHE_DEFAULT,
+    CACHE_RELAXED
+};
+enum {
+    IO_DEFAULT,
+    IO_THROUGHPUT,
+    IO_WRITEBACK,
+    IO_PASSTHROUGH
+};
 struct Disorderfs_config {
     // ATTENTION! Members of this struct MUST be ints, even the booleans, because
     // that's what fuse_opt_parse expects.  Take heed or you will get memory corruption!
     int                        multi_user{0};
     int                        shuffle_dirents{0};
+    int                        shuffle_seed{0};
+    int                        shuffle_seeded{0};
     int                        reverse_dirents{1};
     int                        sort_dirents{0};
     int                        pad_blocks{1};
     int                        share_locks{0};
     int                        quiet{0};
     int                        sort_by_ctime{0};
+    int                        dirfd_cache{0};
+    int                        listing_cache{0};
+    int                        listing_memory{0};
+    int                        trace_buffer{65536};
+    int                        negative_cache{0};
+    int                        xattr_cache{0};
+    int                        security_xattrs{1};
+    int                        ctime_threads{1};
+    int                        cache{CACHE_DEFAULT};
+    int                        io{IO_DEFAULT};
+    int                        min_threads{1};
+    int                        max_threads{0};
+    int                        ready_fd{-1};
 };
 Disorderfs_config                config;
 
@@ -72,242 +137,4082 @@ void perror_and_die (const char* s)
 int wrap (int retval) {
     return retval == -1 ? -errno : 0;
 }
-using Dirents = std::vector<std::pair<std::string, ino_t>>;
 
-typedef std::pair<timespec, std::pair<std::string, ino_t>> Ctime_Dirent_pair;
+// Every operation we implement, for the per-operation metrics
+#if FUSE_USE_VERSION >= 30
+#define DISORDERFS_OPERATIONS(X) \
+    X(lookup) X(forget) X(forget_multi) X(getattr) X(setattr) X(readlink) \
+    X(mknod) X(mkdir) X(unlink) X(rmdir) X(symlink) X(rename) X(link) \
+    X(open) X(read) X(write_buf) X(flush) X(release) X(fsync) X(opendir) \
+    X(readdir) X(readdirplus) X(releasedir) X(fsyncdir) X(statfs) \
+    X(setxattr) X(getxattr) X(listxattr) X(removexattr) X(create) \
+    X(getlk) X(setlk) X(flock) X(fallocate) X(copy_file_range) X(lseek)
+#else
+#define DISORDERFS_OPERATIONS(X) \
+    X(getattr) X(readlink) X(mknod) X(mkdir) X(unlink) X(rmdir) X(symlink) \
+    X(rename) X(link) X(chmod) X(chown) X(truncate) X(open) X(read) X(write) \
+    X(statfs) X(flush) X(release) X(fsync) X(setxattr) X(getxattr) \
+    X(listxattr) X(removexattr) X(opendir) X(readdir) X(releasedir) \
+    X(fsyncdir) X(create) X(ftruncate) X(fgetattr) X(lock) X(flock) \
+    X(utimens) X(write_buf) X(read_buf) X(fallocate)
+#endif
 
-// Overload timespec operator
-bool operator< (const timespec first, const timespec second){
-    if(first.tv_sec < second.tv_sec){
-        return true;
-    } else if (first.tv_sec == second.tv_sec)
-    {
-        return first.tv_nsec < second.tv_nsec;
-    }
-    return false; // first_seconds > second_seconds
+enum Operation {
+#define DISORDERFS_OPERATION_ENUM(name) OP_##name,
+    DISORDERFS_OPERATIONS(DISORDERFS_OPERATION_ENUM)
+#undef DISORDERFS_OPERATION_ENUM
+    OP_COUNT
 };
 
-// At least provide a known value if lstat happens to fail to avoid data corruption
-const timespec INVALID = {0,0};
+const char* const operation_names[OP_COUNT] = {
+#define DISORDERFS_OPERATION_NAME(name) #name,
+    DISORDERFS_OPERATIONS(DISORDERFS_OPERATION_NAME)
+#undef DISORDERFS_OPERATION_NAME
+};
 
-// We found that std::sort was corrupting the data with the naive implementation of calling
-// lstat() during each comparison execution (probably because the value was not stable for the same element between comparisons)
-// this creates a stable sequence of timespecs for sort 
-// we trade memory for code legibility given the c++11 restriction
-/*
- * @param dirents The data in the form of a vector of file/dir-name and inode pairs
- * @param abspath The absolute path to the root of the directory the data was read from (assuming posix)
-*/
-std::vector<Ctime_Dirent_pair> create_ctime_dirents_list(std::unique_ptr<Dirents>& dirents, std::string abspath){
-    // include a trailing '/' if necessary, assuming posix
-    if(abspath.back() != '/'){
-        abspath.push_back('/');
-    }
-    // Iterate through the dirents list and call lstat() exactly once on each entry
-    std::vector<Ctime_Dirent_pair> result;
-    for(auto i = dirents->begin(); i < dirents->end(); i++){
-        std::string el_abspath = abspath;
-        el_abspath.append(i->first);
-        struct stat buffer;
-        int status = lstat(el_abspath.c_str(), &buffer);
-        timespec ctime;
-        if (status != 0){
-            std::cerr << "WARNING: lstat returned " << status << " for \n" << el_abspath << std::endl;
-            std::cerr << "WARNING: replacing ctime with {0s, 0ns}" << std::endl;
-            ctime = INVALID;
-        } else {
-            ctime = buffer.st_ctim;
-        }
-        Ctime_Dirent_pair new_element = {ctime, *i};
-        result.push_back(new_element);
+uint64_t monotonic_ns ()
+{
+    struct timespec                ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Each counter is only ever written by the thread that owns it (or, for the
+// totals of retired threads, under all_thread_stats_mutex), so a relaxed
+// load and store is enough to bump it; the atomics are just so that the
+// thread dumping totals never sees a torn value.
+void bump (std::atomic<uint64_t>& counter, uint64_t by = 1)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+// Counts of values in power-of-two buckets: bucket b holds values < 2^b
+struct Histogram {
+    static const int                BUCKETS = 48;
+    std::atomic<uint64_t>        buckets[BUCKETS];
+
+    void add (uint64_t value)
+    {
+        int                        b = value == 0 ? 0 : 64 - __builtin_clzll(value);
+        bump(buckets[std::min(b, BUCKETS - 1)]);
     }
-    return result;
 };
 
-bool compare_ctime_dirents(Ctime_Dirent_pair a, Ctime_Dirent_pair b){
-    return a.first < b.first;
+struct Operation_stats {
+    std::atomic<uint64_t>        count;
+    std::atomic<uint64_t>        errors;
+    std::atomic<uint64_t>        bytes;
+    Histogram                        latency_ns;
 };
 
-// PRE: dirents.size() == sorted_interim.size()
-void overwrite_dirents(std::unique_ptr<Dirents>& dirents, std::vector<Ctime_Dirent_pair>& sorted_interim){
-    for(long unsigned int i = 0; i < sorted_interim.size(); i++){
-        *(dirents->begin() + i) = (sorted_interim.begin() + i)->second;
-    }
+struct Thread_stats {
+    Operation_stats                operations[OP_COUNT];
+    Histogram                        listing_entries;
+    Histogram                        listing_read_ns;
+    Histogram                        listing_ctime_ns;
+    Histogram                        listing_sort_ns;
 };
 
-// The libc versions of seteuid, etc. set the credentials for all threads.
-// We need to set credentials for a single thread only, so call the syscalls directly.
-int thread_seteuid (uid_t euid)
+// Stats are allocated per thread on first use.  When a thread exits, its
+// counts are added to retired_stats, so that the totals still include the
+// threads that the worker pool has since retired.
+std::mutex                        all_thread_stats_mutex;
+Thread_stats                        retired_stats;
+std::vector<Thread_stats*>        all_thread_stats{&retired_stats};
+
+void add_histogram (Histogram& to, const Histogram& from)
 {
-#ifdef SYS_setresuid32
-    return syscall(SYS_setresuid32, static_cast<uid_t>(-1), euid, static_cast<uid_t>(-1));
-#else
-    return syscall(SYS_setresuid, static_cast<uid_t>(-1), euid, static_cast<uid_t>(-1));
-#endif
+    for (int b = 0; b < Histogram::BUCKETS; ++b) {
+        bump(to.buckets[b], from.buckets[b].load(std::memory_order_relaxed));
+    }
 }
-int thread_setegid (gid_t egid)
+
+// Called with all_thread_stats_mutex held, which makes it the only writer
+void add_stats (Thread_stats& to, const Thread_stats& from)
 {
-#ifdef SYS_setresgid32
-    return syscall(SYS_setresgid32, static_cast<gid_t>(-1), egid, static_cast<gid_t>(-1));
-#else
-    return syscall(SYS_setresgid, static_cast<gid_t>(-1), egid, static_cast<gid_t>(-1));
-#endif
+    for (int op = 0; op < OP_COUNT; ++op) {
+        bump(to.operations[op].count, from.operations[op].count.load(std::memory_order_relaxed));
+        bump(to.operations[op].errors, from.operations[op].errors.load(std::memory_order_relaxed));
+        bump(to.operations[op].bytes, from.operations[op].bytes.load(std::memory_order_relaxed));
+        add_histogram(to.operations[op].latency_ns, from.operations[op].latency_ns);
+    }
+    add_histogram(to.listing_entries, from.listing_entries);
+    add_histogram(to.listing_read_ns, from.listing_read_ns);
+    add_histogram(to.listing_ctime_ns, from.listing_ctime_ns);
+    add_histogram(to.listing_sort_ns, from.listing_sort_ns);
 }
-int thread_setgroups (size_t size, const gid_t* list)
+
+class Thread_stats_holder {
+    std::unique_ptr<Thread_stats>        stats;
+
+public:
+    Thread_stats& get ()
+    {
+        if (!stats) {
+            stats.reset(new Thread_stats());
+            std::lock_guard<std::mutex>        lock(all_thread_stats_mutex);
+            all_thread_stats.push_back(stats.get());
+        }
+        return *stats;
+    }
+
+    ~Thread_stats_holder ()
+    {
+        if (!stats) {
+            return;
+        }
+        std::lock_guard<std::mutex>        lock(all_thread_stats_mutex);
+        add_stats(retired_stats, *stats);
+        all_thread_stats.erase(std::find(all_thread_stats.begin(), all_thread_stats.end(), stats.get()));
+    }
+};
+
+Thread_stats& thread_stats ()
 {
-#ifdef SYS_setgroups32
-    return syscall(SYS_setgroups32, size, list);
-#else
-    return syscall(SYS_setgroups, size, list);
-#endif
+    static thread_local Thread_stats_holder        holder;
+    return holder.get();
 }
 
-std::vector<gid_t> get_fuse_groups ()
+bool metrics_enabled ()
 {
-    long                                ngroups_max = sysconf(_SC_NGROUPS_MAX);
-    if (ngroups_max < 0) {
-        ngroups_max = 65536;
+    return !stats_file.empty();
+}
+
+// The last few operations, for --trace-file.  Writers never wait: each claims
+// the next slot with a fetch_add, and marks it with an odd sequence number
+// while filling it in, so that the dump can skip slots caught half-written.
+class Trace_ring {
+    struct Slot {
+        std::atomic<uint64_t>        sequence{0};        // 2n+1 while record n is written, 2n+2 once done
+        std::atomic<uint64_t>        time_ns{0};
+        std::atomic<uint64_t>        path_hash{0};
+        std::atomic<uint64_t>        latency_ns{0};
+        std::atomic<int>        operation{0};
+        std::atomic<int>        result{0};
+    };
+
+    std::unique_ptr<Slot[]>        slots;
+    size_t                        size{0};        // a power of two
+    std::atomic<uint64_t>        next{0};
+
+public:
+    void set_capacity (size_t capacity)
+    {
+        for (size = 1; size < capacity; size <<= 1) { }
+        slots.reset(new Slot[size]);
     }
-    std::vector<gid_t>                groups(ngroups_max + 1);
-    int                                ngroups = fuse_getgroups(groups.size(), groups.data());
-    if (ngroups < 0) {
-        std::perror("fuse_getgroups");
-        groups.clear();
-    } else if (static_cast<unsigned int>(ngroups) < groups.size()) {
-        groups.resize(ngroups);
+    bool enabled () const { return size > 0; }
+
+    void record (int operation, uint64_t path_hash, uint64_t time_ns, uint64_t latency_ns, int result)
+    {
+        const uint64_t                n = next.fetch_add(1, std::memory_order_relaxed);
+        Slot&                        slot = slots[n & (size - 1)];
+        slot.sequence.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.time_ns.store(time_ns, std::memory_order_relaxed);
+        slot.path_hash.store(path_hash, std::memory_order_relaxed);
+        slot.latency_ns.store(latency_ns, std::memory_order_relaxed);
+        slot.operation.store(operation, std::memory_order_relaxed);
+        slot.result.store(result, std::memory_order_relaxed);
+        slot.sequence.store(2 * n + 2, std::memory_order_release);
     }
-    return groups;
+
+    template<class Write> void for_each (Write write) const
+    {
+        const uint64_t                end = next.load(std::memory_order_acquire);
+        for (uint64_t n = end > size ? end - size : 0; n < end; ++n) {
+            const Slot&                slot = slots[n & (size - 1)];
+            if (slot.sequence.load(std::memory_order_acquire) != 2 * n + 2) {
+                continue;
+            }
+            const uint64_t        time_ns = slot.time_ns.load(std::memory_order_relaxed);
+            const uint64_t        path_hash = slot.path_hash.load(std::memory_order_relaxed);
+            const uint64_t        latency_ns = slot.latency_ns.load(std::memory_order_relaxed);
+            const int                operation = slot.operation.load(std::memory_order_relaxed);
+            const int                result = slot.result.load(std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot.sequence.load(std::memory_order_relaxed) == 2 * n + 2) {
+                write(time_ns, operation, path_hash, latency_ns, result);
+            }
+        }
+    }
+};
+Trace_ring                        trace_ring;
+
+// 64-bit FNV-1a, so that traces can be matched against a path without
+// recording the path itself.  0 for operations on an open fd.
+uint64_t path_hash (const char* path)
+{
+    if (!path) {
+        return 0;
+    }
+    uint64_t                        hash = UINT64_C(0xcbf29ce484222325);
+    for (; *path; ++path) {
+        hash = (hash ^ static_cast<unsigned char>(*path)) * UINT64_C(0x100000001b3);
+    }
+    return hash;
 }
 
-void drop_privileges ()
+// Sums a histogram over every thread, then writes count and approximate
+// (bucket upper bound) p50 and p99.
+template<class Get> void write_histogram (std::ostream& out, const std::vector<Thread_stats*>& threads, Get get)
 {
-    // These functions should not fail as long as disorderfs is running as root.
-    // If they do fail, things could be in a pretty inconsistent state, so just
-    // kill the program instead of trying to gracefully recover.
-    const std::vector<gid_t>        groups(get_fuse_groups());
-    if (thread_setgroups(groups.size(), groups.data()) == -1) {
-        perror_and_die("setgroups");
+    uint64_t                        totals[Histogram::BUCKETS] = {};
+    uint64_t                        count = 0;
+    for (const Thread_stats* stats : threads) {
+        const Histogram&        histogram = get(*stats);
+        for (int b = 0; b < Histogram::BUCKETS; ++b) {
+            totals[b] += histogram.buckets[b].load(std::memory_order_relaxed);
+        }
     }
-    if (thread_setegid(fuse_get_context()->gid) == -1) {
-        perror_and_die("setegid");
+    for (int b = 0; b < Histogram::BUCKETS; ++b) {
+        count += totals[b];
     }
-    if (thread_seteuid(fuse_get_context()->uid) == -1) {
-        perror_and_die("seteuid");
+    out << '\t' << count;
+    for (const double quantile : {0.5, 0.99}) {
+        uint64_t                seen = 0;
+        int                        b = 0;
+        for (; b < Histogram::BUCKETS - 1; ++b) {
+            seen += totals[b];
+            if (count > 0 && seen >= quantile * count) {
+                break;
+            }
+        }
+        out << '\t' << (count > 0 ? (UINT64_C(1) << b) : 0);
     }
 }
 
-void restore_privileges ()
+// Memory held by directory listings, and how many were dropped from idle
+// handles to stay within --listing-memory.  Kept even without --stats-file,
+// because --listing-memory needs the former.
+std::atomic<size_t>                listing_memory{0};
+std::atomic<uint64_t>                listing_evictions{0};
+
+// Writes the totals to stats_file, via a temporary file so that readers
+// never see a half-written one
+void dump_stats ()
 {
-    // These functions should not fail as long as disorderfs is running as root.
-    // If they do fail, things could be in a pretty inconsistent state, so just
-    // kill the program instead of trying to gracefully recover.
-    const std::vector<gid_t>        groups;
-    if (thread_seteuid(0) == -1) {
-        perror_and_die("seteuid()");
+    std::lock_guard<std::mutex>        lock(all_thread_stats_mutex);
+    const std::string                tmp_file = stats_file + ".tmp";
+    std::ofstream                        out(tmp_file);
+
+    out << "# operation\tcount\terrors\tbytes\tlatency_count\tp50_ns\tp99_ns" << std::endl;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        uint64_t                count = 0;
+        uint64_t                errors = 0;
+        uint64_t                bytes = 0;
+        for (const Thread_stats* stats : all_thread_stats) {
+            count += stats->operations[op].count.load(std::memory_order_relaxed);
+            errors += stats->operations[op].errors.load(std::memory_order_relaxed);
+            bytes += stats->operations[op].bytes.load(std::memory_order_relaxed);
+        }
+        out << operation_names[op] << '\t' << count << '\t' << errors << '\t' << bytes;
+        write_histogram(out, all_thread_stats, [op] (const Thread_stats& stats) -> const Histogram& { return stats.operations[op].latency_ns; });
+        out << std::endl;
     }
-    if (thread_setegid(0) == -1) {
-        perror_and_die("setegid(0)");
+
+    out << "# listing\tcount\tp50\tp99" << std::endl;
+    out << "entries";
+    write_histogram(out, all_thread_stats, [] (const Thread_stats& stats) -> const Histogram& { return stats.listing_entries; });
+    out << std::endl << "read_ns";
+    write_histogram(out, all_thread_stats, [] (const Thread_stats& stats) -> const Histogram& { return stats.listing_read_ns; });
+    out << std::endl << "ctime_ns";
+    write_histogram(out, all_thread_stats, [] (const Thread_stats& stats) -> const Histogram& { return stats.listing_ctime_ns; });
+    out << std::endl << "sort_ns";
+    write_histogram(out, all_thread_stats, [] (const Thread_stats& stats) -> const Histogram& { return stats.listing_sort_ns; });
+    out << std::endl;
+
+    out << "# memory\tvalue" << std::endl;
+    out << "listing_bytes\t" << listing_memory.load(std::memory_order_relaxed) << std::endl;
+    out << "listing_evictions\t" << listing_evictions.load(std::memory_order_relaxed) << std::endl;
+
+    out.close();
+    if (!out || std::rename(tmp_file.c_str(), stats_file.c_str()) == -1) {
+        std::perror(stats_file.c_str());
     }
-    if (thread_setgroups(groups.size(), groups.data()) == -1) {
-        perror_and_die("setgroups(0)");
+}
+
+void dump_trace ()
+{
+    const std::string                tmp_file = trace_file + ".tmp";
+    std::ofstream                        out(tmp_file);
+
+    out << "# time_ns\toperation\tpath_hash\tlatency_ns\tresult" << std::endl;
+    trace_ring.for_each([&out] (uint64_t time_ns, int operation, uint64_t hash, uint64_t latency_ns, int result) {
+        char                        hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+        out << time_ns << '\t' << operation_names[operation] << '\t' << hex << '\t' << latency_ns << '\t' << result << '\n';
+    });
+
+    out.close();
+    if (!out || std::rename(tmp_file.c_str(), trace_file.c_str()) == -1) {
+        std::perror(trace_file.c_str());
     }
 }
 
-struct Guard {
-    Guard ()
+// What disorderfs-replay needs to know about an operation besides its path
+struct Operation_args {
+    const char*                        path2{nullptr};        // the other path of rename, link and symlink, or an xattr name
+    uint64_t                        size{0};
+    int64_t                        offset{0};
+    uint64_t                        fh{0};
+    int                                flags{0};
+    unsigned int                mode{0};
+};
+
+// --record: a line for every operation, written as it returns (so in order
+// of completion), with enough of its arguments for disorderfs-replay to do
+// it again.  Buffered, and only complete once disorderfs exits.
+class Recorder {
+    std::mutex                        mutex;
+    FILE*                        file{nullptr};
+    std::atomic<unsigned int>        threads{0};
+
+    // Paths can contain anything but NUL, so escape what would break the line
+    static void append_field (std::string& line, const char* str)
     {
-        if (config.multi_user && getuid() == 0) {
-            drop_privileges();
+        line += '\t';
+        if (!str) {
+            line += '-';
+            return;
+        }
+        for (; *str; ++str) {
+            switch (*str) {
+            case '\t':        line += "\\t"; break;
+            case '\n':        line += "\\n"; break;
+            case '\\':        line += "\\\\"; break;
+            default:        line += *str; break;
+            }
         }
     }
-    ~Guard ()
+
+public:
+    bool enabled () const { return file != nullptr; }
+
+    bool open (const std::string& path)
     {
-        if (config.multi_user && getuid() == 0) {
-            restore_privileges();
+        if (!(file = std::fopen(path.c_str(), "we"))) {
+            return false;
+        }
+        std::setvbuf(file, nullptr, _IOFBF, 1 << 20);
+        std::fputs("# time_ns\tthread\toperation\tresult\tlatency_ns\tpath\tpath2\tsize\toffset\tfh\tflags\tmode\n", file);
+        return true;
+    }
+    ~Recorder ()
+    {
+        if (file) {
+            std::fclose(file);
+        }
+    }
+
+    void record (int operation, uint64_t time_ns, uint64_t latency_ns, int result, const char* path, const Operation_args& args)
+    {
+        static thread_local unsigned int        thread = ++threads;
+        static thread_local std::string                line;
+        line = std::to_string(time_ns);
+        line += '\t';
+        line += std::to_string(thread);
+        line += '\t';
+        line += operation_names[operation];
+        line += '\t';
+        line += std::to_string(result);
+        line += '\t';
+        line += std::to_string(latency_ns);
+        append_field(line, path);
+        append_field(line, args.path2);
+        for (const uint64_t number : {args.size, static_cast<uint64_t>(args.offset), args.fh}) {
+            line += '\t';
+            line += std::to_string(number);
         }
+        line += '\t';
+        line += std::to_string(args.flags);
+        line += '\t';
+        line += std::to_string(args.mode);
+        line += '\n';
+        std::lock_guard<std::mutex>        lock(mutex);
+        std::fwrite(line.data(), 1, line.size(), file);
     }
 };
+Recorder                        recorder;
 
-template<class T> void set_fuse_data (struct fuse_file_info* fi, T data)
+// Waits for SIGUSR1 and SIGUSR2, which main() blocks in every thread, and
+// dumps the stats or the trace
+void signal_thread ()
 {
-    static_assert(sizeof(data) <= sizeof(fi->fh),
-                  "fuse_file_info::fh too small to store data");
-    std::memcpy(&fi->fh, &data, sizeof(data));
+    sigset_t                        signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGUSR1);
+    sigaddset(&signals, SIGUSR2);
+    int                                sig;
+    while (sigwait(&signals, &sig) == 0) {
+        if (sig == SIGUSR1 && metrics_enabled()) {
+            dump_stats();
+        } else if (sig == SIGUSR2 && trace_ring.enabled()) {
+            dump_trace();
+        }
+    }
 }
 
-template<class T> T get_fuse_data (struct fuse_file_info* fi)
+#if FUSE_USE_VERSION < 30
+// How many bytes an operation moved, given its result and arguments
+template<class... Args> uint64_t operation_bytes (int op, int res, Args...)
 {
-    T data;
-    static_assert(sizeof(data) <= sizeof(fi->fh),
-                  "fuse_file_info::fh too small to store data");
-    std::memcpy(&data, &fi->fh, sizeof(data));
-    return data;
+    return (op == OP_read || op == OP_write || op == OP_write_buf) && res > 0 ? res : 0;
+}
+uint64_t operation_bytes (int op, int res, const char*, struct fuse_bufvec**, size_t size, off_t, struct fuse_file_info*)
+{
+    return res == 0 ? size : 0; // libfuse does the actual reading once read_buf returns
 }
 
-struct fuse_operations                disorderfs_fuse_operations;
-enum {
-    KEY_HELP,
-    KEY_VERSION,
-    KEY_QUIET
+// The path an operation is about, for tracing: its first argument, except
+// for symlink, whose first argument is the link's target
+template<class... Args> const char* operation_path (int op, Args...)
+{
+    return nullptr;
+}
+template<class... Args> const char* operation_path (int op, const char* path, Args...)
+{
+    return path;
+}
+const char* operation_path (int op, const char* target, const char* linkpath)
+{
+    return op == OP_symlink ? linkpath : target;
+}
+
+// Fills in Operation_args.  The open file, if any, comes from whichever
+// argument is the fuse_file_info, read after the operation so that open,
+// create and opendir give the handle they returned; the rest depends on
+// the operation.
+template<class T> void note_file (Operation_args&, T) { }
+void note_file (Operation_args& a, struct fuse_file_info* info)
+{
+    a.fh = info->fh;
+    a.flags = info->flags;
+}
+template<class... Args> void note_operation (Operation_args& a, int op, Args...) { }
+template<class... Args> void note_operation (Operation_args& a, int op, const char* path, const char* second, Args...)
+{
+    if (op == OP_rename || op == OP_link || op == OP_removexattr) {
+        a.path2 = second;
+    } else if (op == OP_symlink) {
+        a.path2 = path; // the target; operation_path gives the link
+    }
+}
+void note_operation (Operation_args& a, int op, const char*, mode_t mode)
+{
+    a.mode = mode; // mkdir, chmod
+}
+void note_operation (Operation_args& a, int op, const char*, mode_t mode, dev_t)
+{
+    a.mode = mode; // mknod
+}
+void note_operation (Operation_args& a, int op, const char*, mode_t mode, struct fuse_file_info*)
+{
+    a.mode = mode; // create
+}
+void note_operation (Operation_args& a, int op, const char*, off_t length)
+{
+    a.offset = length; // truncate
+}
+void note_operation (Operation_args& a, int op, const char*, off_t length, struct fuse_file_info*)
+{
+    a.offset = length; // ftruncate
+}
+template<class T> void note_operation (Operation_args& a, int op, const char*, T*, size_t size, off_t offset, struct fuse_file_info*)
+{
+    a.size = size; // read, write, read_buf
+    a.offset = offset;
+}
+void note_operation (Operation_args& a, int op, const char*, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info*)
+{
+    a.size = fuse_buf_size(buf); // write_buf
+    a.offset = offset;
+}
+void note_operation (Operation_args& a, int op, const char*, void*, fuse_fill_dir_t, off_t offset, struct fuse_file_info*)
+{
+    a.offset = offset; // readdir
+}
+void note_operation (Operation_args& a, int op, const char*, int mode, off_t offset, off_t length, struct fuse_file_info*)
+{
+    a.size = length; // fallocate
+    a.offset = offset;
+    a.mode = mode;
+}
+void note_operation (Operation_args& a, int op, const char*, const char* name, char*, size_t size)
+{
+    a.path2 = name; // getxattr
+    a.size = size;
+}
+void note_operation (Operation_args& a, int op, const char*, char*, size_t size)
+{
+    a.size = size; // listxattr, readlink
+}
+void note_operation (Operation_args& a, int op, const char*, const char* name, const char*, size_t size, int flags)
+{
+    a.path2 = name; // setxattr
+    a.size = size;
+    a.flags = flags;
+}
+
+template<class... Args> Operation_args operation_args (int op, Args... args)
+{
+    Operation_args                a;
+    note_operation(a, op, args...);
+    const int                        unused[] = {0, (note_file(a, args), 0)...};
+    (void)unused;
+    return a;
+}
+
+// Wraps each operation for the metrics, the trace ring, --record and the USDT probes
+// disorderfs:operation__entry(op, name, path) and
+// disorderfs:operation__return(op, name, result)
+template<int OP, class... Args> struct Instrumented {
+    static int                (*inner) (Args...);
+
+    static int call (Args... args)
+    {
+        DTRACE_PROBE3(disorderfs, operation__entry, OP, operation_names[OP], operation_path(OP, args...));
+        const bool                timed = metrics_enabled() || trace_ring.enabled() || recorder.enabled();
+        const uint64_t                start = timed ? monotonic_ns() : 0;
+        const int                res = inner(args...);
+        DTRACE_PROBE3(disorderfs, operation__return, OP, operation_names[OP], res);
+        if (!timed) {
+            return res;
+        }
+        const uint64_t                end = monotonic_ns();
+        if (metrics_enabled()) {
+            Operation_stats&        stats = thread_stats().operations[OP];
+            bump(stats.count);
+            if (res < 0) {
+                bump(stats.errors);
+            }
+            bump(stats.bytes, operation_bytes(OP, res, args...));
+            stats.latency_ns.add(end - start);
+        }
+        if (trace_ring.enabled()) {
+            trace_ring.record(OP, path_hash(operation_path(OP, args...)), start, end - start, res);
+        }
+        if (recorder.enabled()) {
+            recorder.record(OP, start, end - start, res, operation_path(OP, args...), operation_args(OP, args...));
+        }
+        return res;
+    }
 };
-#define DISORDERFS_OPT(t, p, v) { t, offsetof(Disorderfs_config, p), v }
-const struct fuse_opt disorderfs_fuse_opts[] = {
-    DISORDERFS_OPT("--multi-user=no", multi_user, false),
-    DISORDERFS_OPT("--multi-user=yes", multi_user, true),
-    DISORDERFS_OPT("--shuffle-dirents=no", shuffle_dirents, false),
-    DISORDERFS_OPT("--shuffle-dirents=yes", shuffle_dirents, true),
-    DISORDERFS_OPT("--reverse-dirents=no", reverse_dirents, false),
-    DISORDERFS_OPT("--reverse-dirents=yes", reverse_dirents, true),
-    DISORDERFS_OPT("--sort-dirents=no", sort_dirents, false),
-    DISORDERFS_OPT("--sort-dirents=yes", sort_dirents, true),
-    DISORDERFS_OPT("--pad-blocks=%i", pad_blocks, 0),
-    DISORDERFS_OPT("--share-locks=no", share_locks, false),
-    DISORDERFS_OPT("--share-locks=yes", share_locks, true),
-    DISORDERFS_OPT("--sort-by-ctime=no", sort_by_ctime, false),
-    DISORDERFS_OPT("--sort-by-ctime=yes", sort_by_ctime, true),
-    FUSE_OPT_KEY("-h", KEY_HELP),
-    FUSE_OPT_KEY("--help", KEY_HELP),
-    FUSE_OPT_KEY("-V", KEY_VERSION),
-    FUSE_OPT_KEY("--version", KEY_VERSION),
-    FUSE_OPT_KEY("-q", KEY_QUIET),
-    FUSE_OPT_KEY("--quiet", KEY_QUIET),
-    FUSE_OPT_END
+template<int OP, class... Args> int (*Instrumented<OP, Args...>::inner) (Args...);
+
+template<int OP, class... Args> void instrument (int (*&operation) (Args...))
+{
+    if (operation) {
+        Instrumented<OP, Args...>::inner = operation;
+        operation = Instrumented<OP, Args...>::call;
+    }
+}
+#else
+// The low-level API hands each operation its request, where the high-level
+// API keeps a per-thread context instead.  Keep one anyway, filled in by
+// Request, so that the code shared with the high-level backend can still
+// find out who is asking, and for which mount.
+struct fuse_context {
+    uid_t                        uid;
+    gid_t                        gid;
+    pid_t                        pid;
+    void*                        private_data;        // the Mount
+    fuse_req_t                        req;
 };
-int fuse_opt_proc (void* data, const char* arg, int key, struct fuse_args* outargs)
+thread_local struct fuse_context        request_context;
+
+struct fuse_context* fuse_get_context ()
+{
+    return &request_context;
+}
+
+int fuse_getgroups (int size, gid_t list[])
+{
+    return fuse_req_getgroups(request_context.req, size, list);
+}
+
+// A low-level operation, from its call to its reply, for the metrics, the
+// trace ring and the USDT probes: what Instrumented does for the high-level
+// API.  Operations reply through it, so that it sees their result.
+// Without paths, the trace hashes the name an operation is given, if any.
+class Request {
+    const fuse_req_t                req;
+    const int                        op;
+    const char* const                name;
+    const bool                        timed;
+    const uint64_t                hash;
+    const uint64_t                start;
+    int                                result{0};
+    uint64_t                        bytes{0};
+
+public:
+    Request (fuse_req_t req, int op, const char* name = nullptr)
+    : req(req), op(op), name(name), timed(metrics_enabled() || trace_ring.enabled()),
+      hash(trace_ring.enabled() ? path_hash(name) : 0), start(timed ? monotonic_ns() : 0)
+    {
+        const struct fuse_ctx*        ctx = fuse_req_ctx(req);
+        request_context.uid = ctx->uid;
+        request_context.gid = ctx->gid;
+        request_context.pid = ctx->pid;
+        request_context.private_data = fuse_req_userdata(req);
+        request_context.req = req;
+        DTRACE_PROBE3(disorderfs, operation__entry, op, operation_names[op], name);
+    }
+    ~Request ()
+    {
+        DTRACE_PROBE3(disorderfs, operation__return, op, operation_names[op], result);
+        if (!timed) {
+            return;
+        }
+        const uint64_t                end = monotonic_ns();
+        if (metrics_enabled()) {
+            Operation_stats&        stats = thread_stats().operations[op];
+            bump(stats.count);
+            if (result < 0) {
+                bump(stats.errors);
+            }
+            bump(stats.bytes, bytes);
+            stats.latency_ns.add(end - start);
+        }
+        if (trace_ring.enabled()) {
+            trace_ring.record(op, hash, start, end - start, result);
+        }
+    }
+    Request (const Request&) = delete;
+    Request& operator= (const Request&) = delete;
+
+    // res is 0 or -errno, as the high-level operations return
+    void reply_err (int res)
+    {
+        result = res;
+        fuse_reply_err(req, -res);
+    }
+    void reply_none ()
+    {
+        fuse_reply_none(req);
+    }
+    // An entry with no inode is a negative entry: ENOENT, cached
+    void reply_entry (const struct fuse_entry_param& e)
+    {
+        result = e.ino ? 0 : -ENOENT;
+        fuse_reply_entry(req, &e);
+    }
+    void reply_create (const struct fuse_entry_param& e, const struct fuse_file_info* fi)
+    {
+        fuse_reply_create(req, &e, fi);
+    }
+    void reply_attr (const struct stat& st, double timeout)
+    {
+        fuse_reply_attr(req, &st, timeout);
+    }
+    void reply_readlink (const char* link)
+    {
+        fuse_reply_readlink(req, link);
+    }
+    void reply_open (const struct fuse_file_info* fi)
+    {
+        fuse_reply_open(req, fi);
+    }
+    void reply_write (size_t count)
+    {
+        result = count;
+        bytes = count;
+        fuse_reply_write(req, count);
+    }
+    void reply_buf (const char* buf, size_t size)
+    {
+        result = size;
+        fuse_reply_buf(req, buf, size);
+    }
+    // The data is only read once it's spliced or copied to the kernel
+    void reply_data (struct fuse_bufvec& bufv, enum fuse_buf_copy_flags flags)
+    {
+        bytes = fuse_buf_size(&bufv);
+        fuse_reply_data(req, &bufv, flags);
+    }
+    void reply_statfs (const struct statvfs& st)
+    {
+        fuse_reply_statfs(req, &st);
+    }
+    // res is the size of the attribute or list in buf, or -errno; a caller
+    // asking for size 0 only wants to know the size
+    void reply_xattr (int res, const char* buf, size_t size)
+    {
+        if (res < 0) {
+            reply_err(res);
+        } else if (size == 0) {
+            result = res;
+            fuse_reply_xattr(req, res);
+        } else {
+            reply_buf(buf, res);
+        }
+    }
+    void reply_lock (const struct flock& lock)
+    {
+        fuse_reply_lock(req, &lock);
+    }
+    void reply_lseek (off_t off)
+    {
+        fuse_reply_lseek(req, off);
+    }
+};
+#endif
+
+// FUSE hands us absolute paths within the mount.  Strip the leading slash so
+// they can be resolved relative to root_fd with the *at() syscalls, and the
+// kernel doesn't have to walk all the way down to root on every operation.
+const char* relative (const char* path)
+{
+    return path[1] == '\0' ? "." : path + 1;
+}
+
+// A few syscalls (truncate, statvfs, the xattr family) have no *at() variant.
+// For those, reach the file through /proc/self/fd/N, which still starts the
+// lookup at the directory fd instead of at /.  An empty rel names the file
+// open on the fd itself.
+class Fd_path {
+    char                        buf[64 + PATH_MAX];
+    std::string                        overflow;
+    const char*                        str;
+public:
+    Fd_path (int dirfd, const char* rel)
+    {
+        const char*                slash = *rel ? "/" : "";
+        const int len = std::snprintf(buf, sizeof(buf), "/proc/self/fd/%d%s%s", dirfd, slash, rel);
+        if (len >= 0 && static_cast<size_t>(len) < sizeof(buf)) {
+            str = buf;
+        } else {
+            overflow = "/proc/self/fd/" + std::to_string(dirfd) + slash + rel;
+            str = overflow.c_str();
+        }
+    }
+    Fd_path (const Fd_path&) = delete;
+    Fd_path& operator= (const Fd_path&) = delete;
+
+    const char* c_str () const { return str; }
+};
+
+// An O_PATH fd for a directory, closed when the last user lets go of it
+struct Dirfd {
+    const int                        fd;
+    explicit Dirfd (int fd) : fd(fd) { }
+    ~Dirfd () { close(fd); }
+    Dirfd (const Dirfd&) = delete;
+    Dirfd& operator= (const Dirfd&) = delete;
+};
+
+// LRU cache of parent directory fds, keyed by path relative to root.
+//
+// The cache is only invalidated by renames and rmdirs made through the mount,
+// so a directory renamed behind our back on the underlying filesystem keeps
+// resolving to its old fd until it falls out of the cache.
+class Dirfd_cache {
+    using Lru = std::list<std::pair<std::string, std::shared_ptr<Dirfd>>>;
+
+    size_t                                        capacity{0};
+    std::mutex                                        mutex;
+    Lru                                                lru;
+    std::unordered_map<std::string, Lru::iterator>        index;
+
+public:
+    void set_capacity (size_t new_capacity) { capacity = new_capacity; }
+    bool enabled () const { return capacity > 0; }
+
+    // Returns nullptr if the directory can't be opened, in which case the
+    // caller should fall back to resolving the full path from root.
+    std::shared_ptr<Dirfd> get (int root_fd, const char* dir, size_t len)
+    {
+        static thread_local std::string        key;
+        key.assign(dir, len);
+
+        std::lock_guard<std::mutex>        lock(mutex);
+        auto                                it = index.find(key);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->second;
+        }
+        const int                        fd = openat(root_fd, key.c_str(), O_PATH | O_DIRECTORY | O_NOFOLLOW);
+        if (fd == -1) {
+            return nullptr;
+        }
+        std::shared_ptr<Dirfd>                dirfd = std::make_shared<Dirfd>(fd);
+        lru.emplace_front(key, dirfd);
+        index[key] = lru.begin();
+        if (lru.size() > capacity) {
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+        return dirfd;
+    }
+
+    // Forget path (relative to root) and everything beneath it
+    void invalidate (const char* path)
+    {
+        if (!enabled()) {
+            return;
+        }
+        const size_t                        len = std::strlen(path);
+        std::lock_guard<std::mutex>        lock(mutex);
+        for (auto it = lru.begin(); it != lru.end(); ) {
+            const std::string&        key = it->first;
+            if (key.compare(0, len, path) == 0 && (key.size() == len || key[len] == '/')) {
+                index.erase(key);
+                it = lru.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+};
+
+// Paths that getattr recently found missing, keyed by FUSE path, so that
+// compilers and loaders probing for files get their ENOENT without a trip to
+// the underlying filesystem.
+//
+// Creating something through the mount forgets its path right away, but
+// files created behind our back on the underlying filesystem stay missing
+// until their entry expires.
+class Negative_cache {
+    static const size_t                        MAX_ENTRIES = 65536;
+
+    time_t                                        ttl{0}; // seconds
+    std::mutex                                        mutex;
+    std::unordered_map<std::string, time_t>        entries;
+
+    static time_t now ()
+    {
+        struct timespec                ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec;
+    }
+
+public:
+    void set_ttl (time_t new_ttl) { ttl = new_ttl; }
+    bool enabled () const { return ttl > 0; }
+
+    bool contains (const char* path)
+    {
+        static thread_local std::string        key;
+        key.assign(path);
+
+        std::lock_guard<std::mutex>        lock(mutex);
+        auto                                it = entries.find(key);
+        if (it == entries.end()) {
+            return false;
+        }
+        if (it->second < now()) {
+            entries.erase(it);
+            return false;
+        }
+        return true;
+    }
+
+    void insert (const char* path)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        if (entries.size() >= MAX_ENTRIES) {
+            entries.clear();
+        }
+        entries[path] = now() + ttl;
+    }
+
+    void invalidate (const char* path)
+    {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex>        lock(mutex);
+        entries.erase(path);
+    }
+
+    void clear ()
+    {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex>        lock(mutex);
+        entries.clear();
+    }
+};
+
+// POSIX locks for --share-locks.  FUSE hands us each lock with the lock owner
+// (in effect, the process) that took it, and POSIX locks belong to the owner
+// and the file, however many times the owner opened it; different owners
+// must still conflict with each other, even through a single shared fh.  So
+// every (inode, owner) pair gets its own open file description, reopened
+// through /proc/self/fd, and takes its locks there as OFD locks: those
+// conflict between descriptions just like POSIX locks conflict between
+// processes, and with the locks other processes take on the underlying
+// filesystem.  A description is opened for what the owner's file was opened
+// for, as a lock through it has to be a kind that file could take itself.
+//
+// Closing a file drops the owner's locks on it, which libfuse 2 passes on as
+// an unlock of the whole file on every flush (the FUSE 3 backend's flush
+// sends it itself).  That closes the owner's description (or, if another of
+// its lock calls is still using it, just drops the locks), so descriptions
+// only outlive the locks they hold until then.
+class Lock_fds {
+    struct Key {
+        dev_t                        dev;
+        ino_t                        ino;
+        uint64_t                owner;
+        bool operator== (const Key& other) const
+        {
+            return dev == other.dev && ino == other.ino && owner == other.owner;
+        }
+    };
+    struct Key_hash {
+        size_t operator() (const Key& key) const
+        {
+            return std::hash<unsigned long long>()((static_cast<unsigned long long>(key.ino) * 31 + key.dev) ^ key.owner);
+        }
+    };
+
+    struct Description {
+        int                        fd;
+        unsigned int                users;        // lock calls using fd right now
+    };
+
+    std::mutex                                                mutex;
+    std::unordered_map<Key, Description, Key_hash>        descriptions;
+
+public:
+    // Takes, tests or drops the owner's lock on the file open as fh, as
+    // fcntl(F_SETLK, F_SETLKW or F_GETLK) would; returns 0 or -errno
+    int lock (uint64_t fh, uint64_t owner, int cmd, struct flock* lock)
+    {
+        struct stat                        st;
+        if (fstat(fh, &st) == -1) {
+            return -errno;
+        }
+        const Key                        key{st.st_dev, st.st_ino, owner};
+        lock->l_pid = 0; // required for OFD locks
+
+        std::unique_lock<std::mutex>        guard(mutex);
+        auto                                it = descriptions.find(key);
+        if (it == descriptions.end()) {
+            if (cmd == F_GETLK) {
+                // An owner without a description holds no locks, so any
+                // description will do to look for others' locks
+                guard.unlock();
+                return fcntl(fh, F_OFD_GETLK, lock) == -1 ? -errno : 0;
+            } else if (lock->l_type == F_UNLCK) {
+                return 0;
+            }
+        } else if (cmd != F_GETLK && lock->l_type == F_UNLCK && lock->l_whence == SEEK_SET &&
+                   lock->l_start == 0 && lock->l_len == 0 && it->second.users == 0) {
+            close(it->second.fd);
+            descriptions.erase(it);
+            return 0;
+        }
+
+        if (it == descriptions.end()) {
+            // With the access mode of the owner's file, so that it can't take
+            // a kind of lock its file couldn't; O_NONBLOCK so that reopening
+            // a FIFO doesn't wait for a peer
+            const int                        flags = fcntl(fh, F_GETFL);
+            if (flags == -1) {
+                return -errno;
+            }
+            const int                        fd = open(("/proc/self/fd/" + std::to_string(fh)).c_str(), (flags & O_ACCMODE) | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+            if (fd == -1) {
+                return -errno;
+            }
+            it = descriptions.emplace(key, Description{fd, 0}).first;
+        }
+        // Don't hold everyone else up while this one waits for its lock.  The
+        // description stays open until it is done, so an unlock of the whole
+        // file meanwhile only drops the locks, as it would for a process.
+        Description&                        description = it->second;
+        ++description.users;
+        guard.unlock();
+        const int                        res = fcntl(description.fd, cmd == F_GETLK ? F_OFD_GETLK : cmd == F_SETLK ? F_OFD_SETLK : F_OFD_SETLKW, lock) == -1 ? -errno : 0;
+        guard.lock();
+        --description.users;
+        return res;
+    }
+};
+Lock_fds                        lock_fds;
+
+// Extended attributes recently read through the mount, and the errors reading
+// them gave (usually ENODATA), keyed by the file's device and inode number and
+// the attribute name, so that every hard link to a file shares them.  The
+// kernel asks for security.capability before many writes, and would
+// otherwise cost a trip to the underlying filesystem every time.  Values and
+// lists are only served to whoever they were read as, down to the groups, as
+// what a user can see depends on who they are: only root sees trusted.*, for
+// one.
+//
+// The high-level API names files by path, so getattr notes the inode each
+// path led to, for the same time as the inode's attributes are kept.
+//
+// Changes made through the mount forget the file's attributes right away.
+// Changes made behind our back show up once the file's entry expires.
+class Xattr_cache {
+public:
+    // Who an attribute was read as: the requester's credentials, or all
+    // zero and no groups for disorderfs's own
+    struct Reader {
+        uid_t                                        uid;
+        gid_t                                        gid;
+        std::shared_ptr<const std::vector<gid_t>>        groups;
+        bool operator== (const Reader& other) const
+        {
+            return uid == other.uid && gid == other.gid &&
+                   (groups == other.groups || (groups && other.groups && *groups == *other.groups));
+        }
+    };
+
+private:
+    struct Key {
+        dev_t                        dev;
+        ino_t                        ino;
+        bool operator== (const Key& other) const { return dev == other.dev && ino == other.ino; }
+    };
+    struct Key_hash {
+        size_t operator() (const Key& key) const
+        {
+            return std::hash<unsigned long long>()(static_cast<unsigned long long>(key.ino) * 31 + key.dev);
+        }
+    };
+    struct Value {
+        std::string                        data;
+        int                                error;                // errno, or 0
+        Reader                                reader;
+    };
+    struct Inode_entry {
+        time_t                                expires;
+        std::unordered_map<std::string, Value> values;
+        bool                                listed{false};
+        Value                                list;
+    };
+    struct Path_entry {
+        time_t                                expires;
+        Key                                key;
+    };
+
+    static const size_t                        MAX_ENTRIES = 65536;
+
+    time_t                                                ttl{0}; // seconds
+    std::mutex                                                mutex;
+    std::unordered_map<Key, Inode_entry, Key_hash>        entries;
+    std::unordered_map<std::string, Path_entry>                paths;        // high-level API only
+
+    static time_t now ()
+    {
+        struct timespec                ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec;
+    }
+
+    // Called with mutex held
+    Inode_entry* find_entry (const Key& key)
+    {
+        auto                                it = entries.find(key);
+        if (it == entries.end()) {
+            return nullptr;
+        }
+        if (it->second.expires < now()) {
+            entries.erase(it);
+            return nullptr;
+        }
+        return &it->second;
+    }
+    Inode_entry& insert_entry (const Key& key)
+    {
+        if (Inode_entry* entry = find_entry(key)) {
+            return *entry;
+        }
+        if (entries.size() >= MAX_ENTRIES) {
+            entries.clear();
+        }
+        Inode_entry&                        entry = entries[key];
+        entry.expires = now() + ttl;
+        return entry;
+    }
+
+public:
+    void set_ttl (time_t new_ttl) { ttl = new_ttl; }
+    bool enabled () const { return ttl > 0; }
+
+    // The attribute called name, or, if name is null, the list of the
+    // file's attributes, as read by reader.  Returns false if not cached.
+    bool find (dev_t dev, ino_t ino, const char* name, const Reader& reader, std::string& data, int& error)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        const Inode_entry*                entry = find_entry(Key{dev, ino});
+        const Value*                        value = nullptr;
+        if (!entry) {
+            return false;
+        } else if (!name) {
+            if (!entry->listed) {
+                return false;
+            }
+            value = &entry->list;
+        } else {
+            auto                        it = entry->values.find(name);
+            if (it == entry->values.end()) {
+                return false;
+            }
+            value = &it->second;
+        }
+        if (!(value->reader == reader)) {
+            return false;
+        }
+        data = value->data;
+        error = value->error;
+        return true;
+    }
+
+    void insert (dev_t dev, ino_t ino, const char* name, const Reader& reader, const char* data, size_t len, int error)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        Inode_entry&                        entry = insert_entry(Key{dev, ino});
+        if (!name) {
+            entry.listed = true;
+            entry.list = Value{std::string(data, len), error, reader};
+        } else {
+            entry.values[name] = Value{std::string(data, len), error, reader};
+        }
+    }
+
+    void invalidate (dev_t dev, ino_t ino)
+    {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex>        lock(mutex);
+        entries.erase(Key{dev, ino});
+    }
+
+    // Notes that path led to the file st describes
+    void set_inode (const char* path, const struct stat& st)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        if (paths.size() >= MAX_ENTRIES) {
+            paths.clear();
+        }
+        paths[path] = Path_entry{now() + ttl, Key{st.st_dev, st.st_ino}};
+    }
+
+    // The file path last led to.  Returns false if not known.
+    bool find_inode (const char* path, dev_t& dev, ino_t& ino)
+    {
+        static thread_local std::string        key;
+        key.assign(path);
+        std::lock_guard<std::mutex>        lock(mutex);
+        auto                                it = paths.find(key);
+        if (it == paths.end()) {
+            return false;
+        }
+        if (it->second.expires < now()) {
+            paths.erase(it);
+            return false;
+        }
+        dev = it->second.key.dev;
+        ino = it->second.key.ino;
+        return true;
+    }
+
+    // Forgets where path leads, and the attributes of the file it led to,
+    // whose inode number may be handed out again once it's gone
+    void forget_path (const char* path)
+    {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex>        lock(mutex);
+        auto                                it = paths.find(path);
+        if (it != paths.end()) {
+            entries.erase(it->second.key);
+            paths.erase(it);
+        }
+    }
+
+    void clear ()
+    {
+        if (!enabled()) {
+            return;
+        }
+        std::lock_guard<std::mutex>        lock(mutex);
+        entries.clear();
+        paths.clear();
+    }
+};
+
+#if FUSE_USE_VERSION >= 30
+// A file the kernel knows by the inode number a lookup gave it.  The
+// low-level API names files that way rather than by path, so each holds an
+// O_PATH fd on the underlying file, and every operation starts from the
+// file itself, or from its parent directory, without walking down from root.
+struct Inode {
+    const int                        fd;                // O_PATH | O_NOFOLLOW
+    const dev_t                        dev;
+    const ino_t                        ino;
+    const mode_t                type;                // the S_IFMT bits
+    uint64_t                        nlookup{0};        // guarded by Inode_table's mutex
+    int                                wd{-1};                // its inotify watch, for directories; likewise
+
+    // The file as of its last open, for deciding whether the kernel may keep
+    // what it has cached of it; see cache_still_valid
+    std::mutex                        mutex;
+    bool                        opened{false};
+    struct timespec                mtime;
+    struct timespec                ctime;
+    off_t                        size;
+    unsigned int                ordering;        // of its listing, for directories
+#ifdef FUSE_CAP_PASSTHROUGH
+    int                                backing_id{0};        // -1 if the kernel refused one; see open_file
+    unsigned int                backing_users{0};
+#endif
+
+    Inode (int fd, const struct stat& st) : fd(fd), dev(st.st_dev), ino(st.st_ino), type(st.st_mode & S_IFMT) { }
+    ~Inode () { close(fd); }
+    Inode (const Inode&) = delete;
+    Inode& operator= (const Inode&) = delete;
+};
+
+// The inodes the kernel knows, keyed by the underlying device and inode
+// number, so that hard links share one.  The fuse_ino_t is the Inode's
+// address.  Each is freed once the kernel has forgotten every lookup that
+// returned it, except the root, which the kernel never looks up and needs
+// for as long as we're mounted.
+class Inode_table {
+    struct Key {
+        dev_t                        dev;
+        ino_t                        ino;
+        bool operator== (const Key& other) const { return dev == other.dev && ino == other.ino; }
+    };
+    struct Key_hash {
+        size_t operator() (const Key& key) const
+        {
+            return std::hash<unsigned long long>()(static_cast<unsigned long long>(key.ino) * 31 + key.dev);
+        }
+    };
+
+    std::mutex                                                        mutex;
+    std::unique_ptr<Inode>                                        root;
+    std::unordered_map<Key, std::unique_ptr<Inode>, Key_hash>        inodes;
+
+    // For a Change_watcher, if the mount has one: its inotify instance and
+    // the pipe that wakes it, the directories it watches by watch
+    // descriptor, and those looked up since it last woke, which it watches
+    // from its own thread as the lookups may be made without the
+    // permission to read them that inotify wants
+    int                                                                inotify_fd{-1};
+    int                                                                wake_fd{-1};
+    std::unordered_map<int, Key>                                watches;
+    std::vector<Key>                                                unwatched;
+
+    // The inode with key, if the kernel knows it; call with mutex held
+    Inode* find (const Key& key)
+    {
+        if (key == Key{root->dev, root->ino}) {
+            return root.get();
+        }
+        const auto                        it = inodes.find(key);
+        return it == inodes.end() ? nullptr : it->second.get();
+    }
+
+public:
+    // Takes ownership of fd; returns false if it can't be stat-ed
+    bool set_root (int fd)
+    {
+        struct stat                        st;
+        if (fstat(fd, &st) == -1) {
+            return false;
+        }
+        root.reset(new Inode(fd, st));
+        return true;
+    }
+
+    Inode& get (fuse_ino_t ino)
+    {
+        return ino == FUSE_ROOT_ID ? *root : *reinterpret_cast<Inode*>(ino);
+    }
+    fuse_ino_t id (const Inode& inode) const
+    {
+        return &inode == root.get() ? FUSE_ROOT_ID : reinterpret_cast<fuse_ino_t>(&inode);
+    }
+
+    // Looks up name in parent, and counts a lookup of the inode it finds.
+    // Fills in e's inode and attributes.  Returns 0 or -errno.
+    int lookup (const Inode& parent, const char* name, struct fuse_entry_param& e)
+    {
+        const int                        fd = openat(parent.fd, name, O_PATH | O_NOFOLLOW | O_CLOEXEC);
+        if (fd == -1) {
+            return -errno;
+        }
+        struct stat                        st;
+        if (fstatat(fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+            const int                saved_errno = errno;
+            close(fd);
+            return -saved_errno;
+        }
+
+        std::lock_guard<std::mutex>        lock(mutex);
+        Inode*                                inode = root.get();
+        if (st.st_dev != root->dev || st.st_ino != root->ino) {
+            std::unique_ptr<Inode>&        slot = inodes[Key{st.st_dev, st.st_ino}];
+            if (!slot) {
+                slot.reset(new Inode(fd, st));
+                if (inotify_fd != -1 && S_ISDIR(st.st_mode)) {
+                    if (unwatched.empty() && write(wake_fd, "", 1) == -1) {
+                        // Full, so it's waking anyway
+                    }
+                    unwatched.push_back(Key{st.st_dev, st.st_ino});
+                }
+            } else {
+                close(fd);
+            }
+            inode = slot.get();
+        } else {
+            close(fd);
+        }
+        ++inode->nlookup;
+        e.ino = id(*inode);
+        e.generation = 0;
+        e.attr = st;
+        return 0;
+    }
+
+    void forget (fuse_ino_t ino, uint64_t nlookup)
+    {
+        if (ino == FUSE_ROOT_ID) {
+            return;
+        }
+        Inode&                                inode = get(ino);
+        std::lock_guard<std::mutex>        lock(mutex);
+        inode.nlookup -= std::min(nlookup, inode.nlookup);
+        if (inode.nlookup == 0) {
+            if (inode.wd != -1) {
+                inotify_rm_watch(inotify_fd, inode.wd);
+                watches.erase(inode.wd);
+            }
+            inodes.erase(Key{inode.dev, inode.ino});
+        }
+    }
+
+    // Starts or, with -1s, stops a Change_watcher's watching of the
+    // directories, beginning with root
+    void set_watcher (int new_inotify_fd, int new_wake_fd)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        inotify_fd = new_inotify_fd;
+        wake_fd = new_wake_fd;
+        for (const auto& watch : watches) {
+            if (Inode* inode = find(watch.second)) {
+                inode->wd = -1;
+            }
+        }
+        watches.clear();
+        unwatched.clear();
+        if (inotify_fd != -1) {
+            unwatched.push_back(Key{root->dev, root->ino});
+        }
+    }
+
+    // Watches the directories looked up since the last call, through their
+    // /proc links.  Returns -errno of the first watch that failed, or 0.
+    int add_watches (uint32_t mask)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        int                                res = 0;
+        for (const Key& key : unwatched) {
+            Inode*                        inode = find(key);
+            if (!inode || inode->wd != -1) {
+                continue;
+            }
+            const int                        wd = inotify_add_watch(inotify_fd, ("/proc/self/fd/" + std::to_string(inode->fd)).c_str(), mask);
+            if (wd == -1) {
+                res = res ? res : -errno;
+                continue;
+            }
+            inode->wd = wd;
+            watches[wd] = key;
+        }
+        unwatched.clear();
+        return res;
+    }
+
+    // Forgets the watch with descriptor wd, which inotify has dropped
+    void unwatch (int wd)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        const auto                        it = watches.find(wd);
+        if (it != watches.end()) {
+            if (Inode* inode = find(it->second)) {
+                inode->wd = -1;
+            }
+            watches.erase(it);
+        }
+    }
+
+    // Finds the directory watched as wd and, if name isn't null, the file
+    // it now has by that name, if the kernel knows it.  Returns false if wd
+    // isn't watched any more.
+    bool find_watched (int wd, const char* name, fuse_ino_t& dir, fuse_ino_t& file)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        const auto                        it = watches.find(wd);
+        Inode*                                inode = it == watches.end() ? nullptr : find(it->second);
+        if (!inode) {
+            return false;
+        }
+        dir = id(*inode);
+        file = 0;
+        struct stat                        st;
+        if (name && fstatat(inode->fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            if (Inode* child = find(Key{st.st_dev, st.st_ino})) {
+                file = id(*child);
+            }
+        }
+        return true;
+    }
+
+    // Every inode the kernel knows
+    std::vector<fuse_ino_t> all ()
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        std::vector<fuse_ino_t>                ids{FUSE_ROOT_ID};
+        for (const auto& entry : inodes) {
+            ids.push_back(id(*entry.second));
+        }
+        return ids;
+    }
+};
+
+// How long the kernel may cache what lookups and getattr tell it, in
+// seconds: --cache's profile, unless -o gives them explicitly
+struct Timeouts {
+    double                        attr;
+    double                        entry;
+    double                        negative;
+};
+#endif
+
+// A ROOTDIR/MOUNTPOINT pair being served.  There's normally just the one
+// from the command line, but with --mounts one daemon serves many, which
+// share its threads, the listing cache and the credential cache.  Each
+// keeps its own options, and the caches keyed by path.
+struct Mount {
+    std::string                        root;
+    std::string                        mountpoint;
+    Disorderfs_config                config;
+    std::vector<std::string>        fuse_options;        // from its line of the --mounts file
+    int                                root_fd{-1};
+    Dirfd_cache                        dirfd_cache;
+    Negative_cache                        negative_cache;
+    Xattr_cache                        xattr_cache;
+#if FUSE_USE_VERSION >= 30
+    Inode_table                        inodes;
+    Timeouts                        timeouts;
+    struct fuse_session*        se{nullptr};
+#else
+    struct fuse_chan*                ch{nullptr};
+    struct fuse*                        fuse{nullptr};
+#endif
+};
+std::list<Mount>                mounts;
+
+// The mount the current request is for
+Mount& this_mount ()
+{
+    return *static_cast<Mount*>(fuse_get_context()->private_data);
+}
+
+// Copies an extended attribute or attribute list out the way getxattr and
+// listxattr do: just its size if size is 0, or ERANGE if it doesn't fit
+int xattr_reply (const std::string& data, char* buf, size_t size)
+{
+    if (size == 0) {
+        return data.size();
+    }
+    if (size < data.size()) {
+        return -ERANGE;
+    }
+    std::memcpy(buf, data.data(), data.size());
+    return data.size();
+}
+
+// Reads an attribute (or, if name is null, the attribute list) into a
+// buffer big enough for any, so that it can be cached whatever size the
+// caller asked for.  follow is for a /proc/self/fd path to the file itself,
+// which has to be followed to reach it.  Returns the size or -errno.
+ssize_t read_xattr (const char* path, const char* name, const char*& data, bool follow = false)
+{
+    static thread_local std::vector<char>        buffer;
+    buffer.resize(XATTR_SIZE_MAX > XATTR_LIST_MAX ? XATTR_SIZE_MAX : XATTR_LIST_MAX);
+    data = buffer.data();
+    ssize_t                                        res;
+    if (name) {
+        res = follow ? getxattr(path, name, buffer.data(), buffer.size()) : lgetxattr(path, name, buffer.data(), buffer.size());
+    } else {
+        res = follow ? listxattr(path, buffer.data(), buffer.size()) : llistxattr(path, buffer.data(), buffer.size());
+    }
+    return res >= 0 ? res : -errno;
+}
+
+// Splits a FUSE path into a directory fd and a name to pass to the *at()
+// syscalls.  Without the dirfd cache, that's just the mount's root_fd and the
+// relative path; with it, the parent directory comes from the cache and the
+// name is a single component.
+struct At_path {
+    std::shared_ptr<Dirfd>        parent;
+    int                                fd;
+    const char*                        name;
+
+    explicit At_path (const char* path) : name(relative(path))
+    {
+        Mount&                        mount = this_mount();
+        fd = mount.root_fd;
+        if (!mount.dirfd_cache.enabled()) {
+            return;
+        }
+        const char*                slash = std::strrchr(name, '/');
+        if (slash == nullptr) {
+            return;
+        }
+        if ((parent = mount.dirfd_cache.get(mount.root_fd, name, slash - name))) {
+            fd = parent->fd;
+            name = slash + 1;
+        }
+    }
+};
+
+// A directory listing.  All of the names live in one contiguous arena and
+// each entry is a small fixed-size record pointing into it.  Reordering the
+// listing only permutes an array of indices, so no strings are ever moved.
+class Dirents {
+public:
+    struct Entry {
+        uint32_t                name_offset;
+        uint16_t                name_length;        // at most NAME_MAX
+        unsigned char                type;                // DT_* from readdir
+        ino_t                        ino;
+        uint64_t                sort_key;
+    };
+
+    // Whether the listing cache holds this listing, which Listing_budget
+    // then leaves alone; guarded by the listing cache's mutex
+    mutable bool                in_cache{false};
+
+private:
+    std::string                        names;        // NUL-separated, for filler's benefit
+    std::vector<Entry>                entries;        // in the order readdir returned them
+    std::vector<uint32_t>        order;                // the order we return them in
+    size_t                        accounted{0};        // what this adds to listing_memory
+
+    // Sorting works on a packed copy of each entry's key, extracted once
+    struct Keyed {
+        uint64_t                key;
+        uint32_t                index;
+    };
+
+    // Below this, radix sort's fixed costs outweigh its linear time
+    static const size_t                RADIX_SORT_MIN = 64;
+
+    template<class Key> std::vector<Keyed> keyed_order (Key key) const
+    {
+        std::vector<Keyed>        keyed;
+        keyed.reserve(order.size());
+        for (uint32_t index : order) {
+            keyed.push_back(Keyed{key(entries[index]), index});
+        }
+        return keyed;
+    }
+    void set_order (const std::vector<Keyed>& keyed)
+    {
+        for (size_t i = 0; i < keyed.size(); ++i) {
+            order[i] = keyed[i].index;
+        }
+    }
+
+    // Stable LSD radix sort, a byte at a time.  Passes over a byte that is
+    // the same in every key wouldn't move anything, and are skipped.
+    static void radix_sort (std::vector<Keyed>& keyed)
+    {
+        if (keyed.size() < RADIX_SORT_MIN) {
+            std::stable_sort(keyed.begin(), keyed.end(), [] (const Keyed& a, const Keyed& b) { return a.key < b.key; });
+            return;
+        }
+        std::vector<size_t>        counts(8 * 256);
+        for (const Keyed& k : keyed) {
+            for (unsigned int digit = 0; digit < 8; ++digit) {
+                ++counts[digit * 256 + (k.key >> (digit * 8) & 0xff)];
+            }
+        }
+        std::vector<Keyed>        scratch(keyed.size());
+        for (unsigned int digit = 0; digit < 8; ++digit) {
+            size_t* const        count = &counts[digit * 256];
+            if (count[keyed[0].key >> (digit * 8) & 0xff] == keyed.size()) {
+                continue;
+            }
+            size_t                offset = 0;
+            for (unsigned int byte = 0; byte < 256; ++byte) {
+                const size_t        n = count[byte];
+                count[byte] = offset;
+                offset += n;
+            }
+            for (const Keyed& k : keyed) {
+                scratch[count[k.key >> (digit * 8) & 0xff]++] = k;
+            }
+            keyed.swap(scratch);
+        }
+    }
+
+    // The first 8 bytes of the name, NUL-padded, so that comparing prefixes
+    // compares names (which can't contain NUL) as far as they go
+    uint64_t name_prefix (const Entry& entry) const
+    {
+        const unsigned char*        name = reinterpret_cast<const unsigned char*>(names.data() + entry.name_offset);
+        uint64_t                key = 0;
+        for (size_t i = 0; i < 8; ++i) {
+            key = key << 8 | (i < entry.name_length ? name[i] : 0);
+        }
+        return key;
+    }
+    bool name_less (const Entry& a, const Entry& b) const
+    {
+        const int                cmp = std::memcmp(names.data() + a.name_offset, names.data() + b.name_offset,
+                                          std::min(a.name_length, b.name_length));
+        return cmp != 0 ? cmp < 0 : a.name_length < b.name_length;
+    }
+
+public:
+    void add (const char* name, ino_t ino, unsigned char type)
+    {
+        const size_t                len = std::strlen(name);
+        entries.push_back(Entry{static_cast<uint32_t>(names.size()), static_cast<uint16_t>(len), type, ino, 0});
+        order.push_back(order.size());
+        names.append(name, len + 1);
+    }
+
+    size_t size () const { return order.size(); }
+
+    // Entries by position in the listing, as currently ordered
+    Entry& operator[] (size_t i) { return entries[order[i]]; }
+    const Entry& operator[] (size_t i) const { return entries[order[i]]; }
+    const char* name (const Entry& entry) const { return names.data() + entry.name_offset; }
+
+    // Sorts by name, byte by byte
+    void sort_by_name ()
+    {
+        std::vector<Keyed>        keyed = keyed_order([this] (const Entry& entry) { return name_prefix(entry); });
+        radix_sort(keyed);
+        // Names that share their first 8 bytes still need comparing in full
+        for (size_t begin = 0, end; begin < keyed.size(); begin = end) {
+            for (end = begin + 1; end < keyed.size() && keyed[end].key == keyed[begin].key; ++end) { }
+            if (end - begin > 1) {
+                std::sort(keyed.begin() + begin, keyed.begin() + end, [this] (const Keyed& a, const Keyed& b) {
+                    return name_less(entries[a.index], entries[b.index]);
+                });
+            }
+        }
+        set_order(keyed);
+    }
+    // Sorts by sort_key; entries with equal keys keep their relative order
+    void sort_by_key ()
+    {
+        std::vector<Keyed>        keyed = keyed_order([] (const Entry& entry) { return entry.sort_key; });
+        radix_sort(keyed);
+        set_order(keyed);
+    }
+    void reverse ()
+    {
+        std::reverse(order.begin(), order.end());
+    }
+
+    size_t memory_usage () const
+    {
+        return sizeof(*this) + names.capacity() + entries.capacity() * sizeof(Entry) + order.capacity() * sizeof(uint32_t);
+    }
+
+    // Counts the listing towards listing_memory, once it's complete and
+    // won't grow any more
+    void account ()
+    {
+        names.shrink_to_fit();
+        entries.shrink_to_fit();
+        order.shrink_to_fit();
+        accounted = memory_usage();
+        listing_memory += accounted;
+    }
+
+    Dirents () = default;
+    Dirents (const Dirents&) = delete;
+    Dirents& operator= (const Dirents&) = delete;
+    ~Dirents ()
+    {
+        listing_memory -= accounted;
+    }
+};
+
+// The libc versions of seteuid, etc. set the credentials for all threads.
+// We need to set credentials for a single thread only, so call the syscalls directly.
+int thread_seteuid (uid_t euid)
+{
+#ifdef SYS_setresuid32
+    return syscall(SYS_setresuid32, static_cast<uid_t>(-1), euid, static_cast<uid_t>(-1));
+#else
+    return syscall(SYS_setresuid, static_cast<uid_t>(-1), euid, static_cast<uid_t>(-1));
+#endif
+}
+int thread_setegid (gid_t egid)
+{
+#ifdef SYS_setresgid32
+    return syscall(SYS_setresgid32, static_cast<gid_t>(-1), egid, static_cast<gid_t>(-1));
+#else
+    return syscall(SYS_setresgid, static_cast<gid_t>(-1), egid, static_cast<gid_t>(-1));
+#endif
+}
+int thread_setgroups (size_t size, const gid_t* list)
+{
+#ifdef SYS_setgroups32
+    return syscall(SYS_setgroups32, size, list);
+#else
+    return syscall(SYS_setgroups, size, list);
+#endif
+}
+
+// Supplementary groups of the process making the current request.  Looking
+// them up means fuse_getgroups() reading /proc/PID/task/TID/status, so the
+// result is cached per (uid, gid, pid) for a short while.  The expiry bounds
+// how long we can miss a setgroups() by that process, or a recycled pid.
+class Groups_cache {
+    struct Key {
+        uid_t                        uid;
+        gid_t                        gid;
+        pid_t                        pid;
+        bool operator== (const Key& other) const
+        {
+            return uid == other.uid && gid == other.gid && pid == other.pid;
+        }
+    };
+    struct Key_hash {
+        size_t operator() (const Key& key) const
+        {
+            return std::hash<unsigned long long>()((static_cast<unsigned long long>(key.uid) << 32 | key.gid) ^
+                                                   (static_cast<unsigned long long>(key.pid) << 16));
+        }
+    };
+    struct Entry {
+        std::shared_ptr<const std::vector<gid_t>>        groups;
+        time_t                                                expires;
+    };
+
+    static const time_t                        TTL = 1; // seconds
+    static const size_t                        MAX_ENTRIES = 4096;
+
+    std::mutex                                        mutex;
+    std::unordered_map<Key, Entry, Key_hash>        entries;
+
+    static time_t now ()
+    {
+        struct timespec                ts;
+        clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+        return ts.tv_sec;
+    }
+
+public:
+    std::shared_ptr<const std::vector<gid_t>> find (const struct fuse_context* ctx)
+    {
+        const Key                        key{ctx->uid, ctx->gid, ctx->pid};
+        std::lock_guard<std::mutex>        lock(mutex);
+        auto                                it = entries.find(key);
+        if (it == entries.end() || it->second.expires < now()) {
+            return nullptr;
+        }
+        return it->second.groups;
+    }
+
+    void insert (const struct fuse_context* ctx, std::shared_ptr<const std::vector<gid_t>> groups)
+    {
+        const Key                        key{ctx->uid, ctx->gid, ctx->pid};
+        std::lock_guard<std::mutex>        lock(mutex);
+        if (entries.size() >= MAX_ENTRIES) {
+            entries.clear();
+        }
+        entries[key] = Entry{std::move(groups), now() + TTL};
+    }
+};
+Groups_cache                        groups_cache;
+
+std::vector<gid_t> get_fuse_groups ()
+{
+    // fuse_getgroups returns the total number of groups even if that doesn't
+    // fit, so start with a small buffer and only grow it when we have to.
+    std::vector<gid_t>                groups(32);
+    int                                ngroups = fuse_getgroups(groups.size(), groups.data());
+    if (ngroups > 0 && static_cast<unsigned int>(ngroups) > groups.size()) {
+        groups.resize(ngroups);
+        ngroups = fuse_getgroups(groups.size(), groups.data());
+    }
+    if (ngroups < 0) {
+        std::perror("fuse_getgroups");
+        groups.clear();
+    } else if (static_cast<unsigned int>(ngroups) < groups.size()) {
+        groups.resize(ngroups);
+    }
+    return groups;
+}
+
+// The credentials the current thread is running with.  Threads are only put
+// back to root when they next serve a request from a different user, an
+// operation on an open file (see As_root), or a mount without
+// --multi-user=yes, so that a thread serving the same user over and over
+// never switches at all.
+struct Thread_credentials {
+    bool                                        known{false};
+    bool                                        dropped{false};
+    uid_t                                        uid{0};
+    gid_t                                        gid{0};
+    std::shared_ptr<const std::vector<gid_t>>        groups;
+};
+thread_local Thread_credentials                thread_credentials;
+
+void restore_privileges ()
+{
+    // These functions should not fail as long as disorderfs is running as root.
+    // If they do fail, things could be in a pretty inconsistent state, so just
+    // kill the program instead of trying to gracefully recover.
+    const std::vector<gid_t>        groups;
+    if (thread_seteuid(0) == -1) {
+        perror_and_die("seteuid()");
+    }
+    if (thread_setegid(0) == -1) {
+        perror_and_die("setegid(0)");
+    }
+    if (thread_setgroups(groups.size(), groups.data()) == -1) {
+        perror_and_die("setgroups(0)");
+    }
+    thread_credentials.known = true;
+    thread_credentials.dropped = false;
+    thread_credentials.groups.reset();
+}
+
+// Switches the current thread to uid, gid and groups, unless it has them
+// already
+void switch_credentials (uid_t uid, gid_t gid, std::shared_ptr<const std::vector<gid_t>> groups)
+{
+    Thread_credentials&                        current = thread_credentials;
+    if (current.dropped && current.uid == uid && current.gid == gid &&
+            (current.groups == groups || *current.groups == *groups)) {
+        return;
+    }
+    if (current.dropped || !current.known) {
+        restore_privileges();
+    }
+
+    // These functions should not fail as long as disorderfs is running as root.
+    // If they do fail, things could be in a pretty inconsistent state, so just
+    // kill the program instead of trying to gracefully recover.
+    if (thread_setgroups(groups->size(), groups->data()) == -1) {
+        perror_and_die("setgroups");
+    }
+    if (thread_setegid(gid) == -1) {
+        perror_and_die("setegid");
+    }
+    if (thread_seteuid(uid) == -1) {
+        perror_and_die("seteuid");
+    }
+    current.dropped = true;
+    current.uid = uid;
+    current.gid = gid;
+    current.groups = std::move(groups);
+}
+
+void drop_privileges ()
+{
+    Thread_credentials&                        current = thread_credentials;
+    const struct fuse_context*                ctx = fuse_get_context();
+
+    // Threads created by libfuse inherit the credentials of whichever thread
+    // created them, so start from a known state.
+    if (!current.known) {
+        restore_privileges();
+    }
+
+    std::shared_ptr<const std::vector<gid_t>>        groups(groups_cache.find(ctx));
+    if (!groups) {
+        // Reading another user's /proc entry may need root
+        if (current.dropped) {
+            restore_privileges();
+        }
+        groups = std::make_shared<const std::vector<gid_t>>(get_fuse_groups());
+        groups_cache.insert(ctx, groups);
+    }
+
+    switch_credentials(ctx->uid, ctx->gid, std::move(groups));
+}
+
+// Gives the current thread the credentials that other, another thread's,
+// describes
+void adopt_credentials (const Thread_credentials& other)
+{
+    if (getuid() != 0) {
+        return;
+    }
+    if (other.dropped) {
+        switch_credentials(other.uid, other.gid, other.groups);
+    } else if (thread_credentials.dropped || !thread_credentials.known) {
+        restore_privileges();
+    }
+}
+
+// Packs a timestamp into a sort key that compares the same way.  Seconds are
+// biased so that times before the epoch still sort first, and clamped to the
+// ~270 years either side of it that fit alongside the nanoseconds.
+uint64_t timespec_key (const struct timespec& ts)
+{
+    const int64_t                bias = INT64_C(1) << 33;
+    const int64_t                sec = std::max(-bias, std::min(bias - 1, static_cast<int64_t>(ts.tv_sec)));
+    return static_cast<uint64_t>(sec + bias) << 30 | static_cast<uint64_t>(ts.tv_nsec);
+}
+
+// At least provide a known value if lstat happens to fail to avoid data corruption
+const timespec INVALID = {0,0};
+
+// Don't bother starting threads for fewer entries than this each
+const size_t MIN_CTIME_ENTRIES_PER_THREAD = 512;
+
+// The underlying path of the directory open on dirfd, for warnings
+std::string directory_path (int dirfd)
+{
+    const std::string        proc_path = "/proc/self/fd/" + std::to_string(dirfd);
+    char                        buf[PATH_MAX];
+    const ssize_t                len = readlink(proc_path.c_str(), buf, sizeof(buf));
+    return len > 0 ? std::string(buf, len) : proc_path;
+}
+
+// We found that std::sort was corrupting the data with the naive implementation of calling
+// lstat() during each comparison execution (probably because the value was not stable for the same element between comparisons)
+// so stat each entry exactly once up front and store its ctime as its sort key
+/*
+ * @param dirents The listing to fill in sort keys for
+ * @param dirfd The directory the listing was read from
+ * @param begin, end The range of entries to fill in
+*/
+void set_ctime_sort_keys (Dirents& dirents, int dirfd, size_t begin, size_t end)
+{
+    for (size_t i = begin; i < end; ++i) {
+        Dirents::Entry& entry = dirents[i];
+        const char* name = dirents.name(entry);
+        timespec ctime = INVALID;
+        // Only ask for the ctime, so filesystems that can skip the rest may do so
+        struct statx stx;
+        if (statx(dirfd, name, AT_SYMLINK_NOFOLLOW, STATX_CTIME, &stx) == 0 && (stx.stx_mask & STATX_CTIME)) {
+            ctime.tv_sec = stx.stx_ctime.tv_sec;
+            ctime.tv_nsec = stx.stx_ctime.tv_nsec;
+        } else {
+            struct stat buffer;
+            if (fstatat(dirfd, name, &buffer, AT_SYMLINK_NOFOLLOW) == 0) {
+                ctime = buffer.st_ctim;
+            } else {
+                const int saved_errno = errno;
+                std::cerr << "WARNING: lstat failed for " << directory_path(dirfd) << "/" << name << ": " << std::strerror(saved_errno) << std::endl;
+                std::cerr << "WARNING: replacing ctime with {0s, 0ns}" << std::endl;
+            }
+        }
+        entry.sort_key = timespec_key(ctime);
+    }
+}
+
+// Threads for the ctime stats of large directories, started as they are
+// first needed and then kept, rather than started and joined for every
+// listing.  Each batch runs with the credentials of the thread that handed
+// it over, just as if that thread did the stats itself.
+class Ctime_pool {
+    struct Batch {
+        Dirents*                dirents;
+        int                        dirfd;
+        size_t                        begin;
+        size_t                        end;
+        Thread_credentials        credentials;
+        size_t*                        pending;        // batches of the listing still to do
+    };
+
+    std::mutex                        mutex;
+    std::condition_variable        batch_ready;
+    std::condition_variable        batch_done;
+    std::deque<Batch>                batches;
+    size_t                        nthreads{0};
+
+    void work ()
+    {
+        std::unique_lock<std::mutex>        lock(mutex);
+        for (;;) {
+            batch_ready.wait(lock, [this] { return !batches.empty(); });
+            const Batch                batch = batches.front();
+            batches.pop_front();
+            lock.unlock();
+            adopt_credentials(batch.credentials);
+            set_ctime_sort_keys(*batch.dirents, batch.dirfd, batch.begin, batch.end);
+            lock.lock();
+            if (--*batch.pending == 0) {
+                batch_done.notify_all();
+            }
+        }
+    }
+
+public:
+    // Fans the stats out over up to config.ctime_threads threads for large
+    // directories, the calling thread being one of them.  If no more threads
+    // can be started, the rest of the entries are done by fewer.
+    void set_sort_keys (Dirents& dirents, int dirfd)
+    {
+        const size_t                        max_threads = config.ctime_threads > 1 ? config.ctime_threads : 1;
+        size_t                                nbatches = std::max<size_t>(1, std::min(max_threads, dirents.size() / MIN_CTIME_ENTRIES_PER_THREAD));
+        std::unique_lock<std::mutex>        lock(mutex);
+        for (; nthreads < nbatches - 1; ++nthreads) {
+            try {
+                std::thread(&Ctime_pool::work, this).detach();
+            } catch (const std::system_error&) {
+                // Out of threads; make do with those there are
+                nbatches = nthreads + 1;
+                break;
+            }
+        }
+        const size_t                        chunk = (dirents.size() + nbatches - 1) / nbatches;
+        size_t                                pending = nbatches - 1;
+        for (size_t b = 1; b < nbatches; ++b) {
+            batches.push_back(Batch{&dirents, dirfd, b * chunk, std::min(dirents.size(), (b + 1) * chunk), thread_credentials, &pending});
+        }
+        batch_ready.notify_all();
+        lock.unlock();
+        set_ctime_sort_keys(dirents, dirfd, 0, std::min(dirents.size(), chunk));
+        lock.lock();
+        batch_done.wait(lock, [&pending] { return pending == 0; });
+    }
+};
+// Never destroyed, as its threads are still waiting on it at exit
+Ctime_pool&        ctime_pool = *new Ctime_pool;
+
+// How the entries of a directory are returned: the mount's --*-dirents
+// options, unless the --policy file says otherwise for that directory
+struct Ordering {
+    bool                        passthrough;        // the underlying order, read as we go
+    bool                        sort;
+    bool                        sort_by_ctime;
+    bool                        reverse;
+    bool                        shuffle;
+
+    // Tells apart orderings that read_listing would order differently
+    unsigned int id () const
+    {
+        return sort | sort_by_ctime << 1 | reverse << 2;
+    }
+};
+
+Ordering default_ordering (const Disorderfs_config& c)
+{
+    return Ordering{false, c.sort_dirents != 0, c.sort_dirents && c.sort_by_ctime, c.reverse_dirents != 0, c.shuffle_dirents != 0};
+}
+
+// Identifies a listing: the underlying directory's device and inode number,
+// and how it was ordered
+struct Listing_key {
+    dev_t                        dev;
+    ino_t                        ino;
+    unsigned int                ordering;
+    Listing_key (const struct stat& st, const Ordering& ordering) : dev(st.st_dev), ino(st.st_ino), ordering(ordering.id()) { }
+    bool operator== (const Listing_key& other) const { return dev == other.dev && ino == other.ino && ordering == other.ordering; }
+};
+struct Listing_key_hash {
+    size_t operator() (const Listing_key& key) const
+    {
+        return std::hash<unsigned long long>()((static_cast<unsigned long long>(key.ino) * 31 + key.dev) * 8 + key.ordering);
+    }
+};
+
+bool same_time (const struct timespec& a, const struct timespec& b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+// If the directory changed in the last couple of seconds, a further change
+// could still leave it with the same timestamps on a filesystem with coarse
+// timestamps, so a listing read now can't be reused on the strength of them.
+bool timestamps_settled (const struct stat& st)
+{
+    struct timespec                now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec - st.st_ctim.tv_sec >= 2;
+}
+
+// Directory listings that have already been read and ordered.  A cached
+// listing is only used while the directory's mtime and ctime are unchanged.
+class Listing_cache {
+    struct Entry {
+        struct timespec                        mtime;
+        struct timespec                        ctime;
+        std::shared_ptr<const Dirents>        listing;
+        size_t                                bytes;
+        std::list<Listing_key>::iterator        lru_position;
+    };
+    using Entries = std::unordered_map<Listing_key, Entry, Listing_key_hash>;
+
+    size_t                                capacity{0};        // bytes
+    std::atomic<size_t>                        used{0};
+    std::mutex                                mutex;
+    std::list<Listing_key>                lru;
+    Entries                                entries;
+
+    void erase (Entries::iterator it)
+    {
+        used -= it->second.bytes;
+        it->second.listing->in_cache = false;
+        lru.erase(it->second.lru_position);
+        entries.erase(it);
+    }
+
+public:
+    void set_capacity (size_t new_capacity) { capacity = new_capacity; }
+    bool enabled () const { return capacity > 0; }
+    size_t memory () const { return used.load(std::memory_order_relaxed); }
+
+    // Whether listing is in the cache
+    bool contains (const Dirents& listing)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        return listing.in_cache;
+    }
+
+    std::shared_ptr<const Dirents> find (const struct stat& st, const Ordering& ordering)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        auto                                it = entries.find(Listing_key(st, ordering));
+        if (it == entries.end()) {
+            return nullptr;
+        }
+        if (!same_time(it->second.mtime, st.st_mtim) || !same_time(it->second.ctime, st.st_ctim)) {
+            erase(it);
+            return nullptr;
+        }
+        lru.splice(lru.begin(), lru, it->second.lru_position);
+        return it->second.listing;
+    }
+
+    // st must come from before the listing was read
+    void insert (const struct stat& st, const Ordering& ordering, std::shared_ptr<const Dirents> listing)
+    {
+        if (!timestamps_settled(st)) {
+            return;
+        }
+        const size_t                        bytes = listing->memory_usage();
+        if (bytes > capacity) {
+            return;
+        }
+        const Listing_key                key(st, ordering);
+        std::lock_guard<std::mutex>        lock(mutex);
+        auto                                it = entries.find(key);
+        if (it != entries.end()) {
+            erase(it);
+        }
+        while (used + bytes > capacity) {
+            erase(entries.find(lru.back()));
+        }
+        lru.push_front(key);
+        listing->in_cache = true;
+        entries.emplace(key, Entry{st.st_mtim, st.st_ctim, std::move(listing), bytes, lru.begin()});
+        used += bytes;
+    }
+};
+Listing_cache                        listing_cache;
+
+// The listings held by open handles, so that opening a directory that is
+// already open shares its listing instead of reading another copy of it.
+// Entries are validated like the listing cache's, and don't keep their
+// listing alive.
+class Open_listings {
+    struct Entry {
+        struct timespec                        mtime;
+        struct timespec                        ctime;
+        std::weak_ptr<const Dirents>        listing;
+    };
+    using Entries = std::unordered_map<Listing_key, Entry, Listing_key_hash>;
+
+    std::mutex                                mutex;
+    Entries                                entries;
+    size_t                                sweep_at{1024};        // sweep out dead entries beyond this many
+
+public:
+    std::shared_ptr<const Dirents> find (const struct stat& st, const Ordering& ordering)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        auto                                it = entries.find(Listing_key(st, ordering));
+        if (it == entries.end()) {
+            return nullptr;
+        }
+        std::shared_ptr<const Dirents>        listing = it->second.listing.lock();
+        if (!listing || !same_time(it->second.mtime, st.st_mtim) || !same_time(it->second.ctime, st.st_ctim)) {
+            entries.erase(it);
+            return nullptr;
+        }
+        return listing;
+    }
+
+    // st must come from before the listing was read
+    void insert (const struct stat& st, const Ordering& ordering, const std::shared_ptr<const Dirents>& listing)
+    {
+        if (!timestamps_settled(st)) {
+            return;
+        }
+        std::lock_guard<std::mutex>        lock(mutex);
+        entries[Listing_key(st, ordering)] = Entry{st.st_mtim, st.st_ctim, listing};
+        if (entries.size() > sweep_at) {
+            for (auto it = entries.begin(); it != entries.end(); ) {
+                it = it->second.listing.expired() ? entries.erase(it) : std::next(it);
+            }
+            sweep_at = std::max<size_t>(1024, entries.size() * 2);
+        }
+    }
+};
+Open_listings                        open_listings;
+
+// The --policy file, compiled into a trie of path components.  Each line of
+// the file is a mode followed by a pattern, relative to the mount's root,
+// whose components may be globs ("*.d"), or "**" for any number of
+// components.  A directory takes the mode of the last line matching it.
+//
+// Literal components are looked up by hash, so a policy without globs is
+// checked in time linear in the length of the path.
+class Policy {
+    struct Node {
+        std::unordered_map<std::string, std::unique_ptr<Node>>        children;
+        std::vector<std::pair<std::string, std::unique_ptr<Node>>>        globs;        // matched with fnmatch
+        std::unique_ptr<Node>                                        any_depth;        // "**"
+        bool                                                        any{false};        // this is a "**"
+        int                                                        rule{-1};        // the last line ending here
+    };
+
+    Node                                root;
+    std::vector<Ordering>        rules;
+
+    static bool parse_mode (const std::string& mode, Ordering& ordering)
+    {
+        ordering = Ordering{};
+        if (mode == "passthrough") {
+            ordering.passthrough = true;
+        } else if (mode == "reverse") {
+            ordering.reverse = true;
+        } else if (mode == "sort") {
+            ordering.sort = true;
+        } else if (mode == "sort-by-ctime") {
+            ordering.sort = ordering.sort_by_ctime = true;
+        } else if (mode == "shuffle") {
+            ordering.shuffle = true;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    void add (const std::string& pattern, int rule)
+    {
+        Node*                        node = &root;
+        std::istringstream        components(pattern);
+        std::string                component;
+        while (std::getline(components, component, '/')) {
+            if (component.empty() || component == ".") {
+                continue;
+            }
+            std::unique_ptr<Node>*        next;
+            if (component == "**") {
+                next = &node->any_depth;
+            } else if (component.find_first_of("*?[") == std::string::npos) {
+                next = &node->children[component];
+            } else {
+                auto                        it = std::find_if(node->globs.begin(), node->globs.end(),
+                                                [&component] (const std::pair<std::string, std::unique_ptr<Node>>& glob) { return glob.first == component; });
+                if (it == node->globs.end()) {
+                    node->globs.emplace_back(component, nullptr);
+                    it = node->globs.end() - 1;
+                }
+                next = &it->second;
+            }
+            if (!*next) {
+                next->reset(new Node);
+                (*next)->any = component == "**";
+            }
+            node = next->get();
+        }
+        node->rule = rule;
+    }
+
+    // Adds node to the nodes matching the path so far, along with the "**"
+    // beneath it, which can match no components at all.  A "**" stays in the
+    // set as further components are matched.
+    static void enter (const Node* node, std::vector<const Node*>& nodes)
+    {
+        for (; node; node = node->any_depth.get()) {
+            if (std::find(nodes.begin(), nodes.end(), node) == nodes.end()) {
+                nodes.push_back(node);
+            }
+        }
+    }
+
+public:
+    bool empty () const { return rules.empty(); }
+
+    // Returns an empty string on success, or else what was wrong with the file
+    std::string load (const std::string& path)
+    {
+        std::ifstream                file(path);
+        if (!file) {
+            return std::strerror(errno);
+        }
+        std::string                line;
+        for (int lineno = 1; std::getline(file, line); ++lineno) {
+            const size_t        start = line.find_first_not_of(" \t");
+            if (start == std::string::npos || line[start] == '#') {
+                continue;
+            }
+            const size_t        mode_end = line.find_first_of(" \t", start);
+            const size_t        pattern_start = mode_end == std::string::npos ? mode_end : line.find_first_not_of(" \t", mode_end);
+            const std::string        mode = line.substr(start, mode_end - start);
+            Ordering                ordering;
+            if (!parse_mode(mode, ordering)) {
+                return "line " + std::to_string(lineno) + ": unknown mode '" + mode + "'";
+            }
+            if (pattern_start == std::string::npos) {
+                return "line " + std::to_string(lineno) + ": missing pattern";
+            }
+            rules.push_back(ordering);
+            add(line.substr(pattern_start), rules.size() - 1);
+        }
+        if (file.bad()) {
+            return std::strerror(errno);
+        }
+        return "";
+    }
+
+    // The ordering for the directory at the FUSE path, or nullptr if no line
+    // matches it
+    const Ordering* find (const char* path) const
+    {
+        static thread_local std::vector<const Node*>        nodes, next_nodes;
+        nodes.clear();
+        enter(&root, nodes);
+        while (*path && !nodes.empty()) {
+            while (*path == '/') {
+                ++path;
+            }
+            const char*                end = std::strchr(path, '/');
+            const size_t        len = end ? end - path : std::strlen(path);
+            if (len == 0) {
+                break;
+            }
+            static thread_local std::string        component;
+            component.assign(path, len);
+            path += len;
+
+            next_nodes.clear();
+            for (const Node* node : nodes) {
+                if (node->any) {
+                    enter(node, next_nodes);
+                }
+                auto                it = node->children.find(component);
+                if (it != node->children.end()) {
+                    enter(it->second.get(), next_nodes);
+                }
+                for (const auto& glob : node->globs) {
+                    if (fnmatch(glob.first.c_str(), component.c_str(), 0) == 0) {
+                        enter(glob.second.get(), next_nodes);
+                    }
+                }
+            }
+            nodes.swap(next_nodes);
+        }
+        int                        rule = -1;
+        for (const Node* node : nodes) {
+            rule = std::max(rule, node->rule);
+        }
+        return rule == -1 ? nullptr : &rules[rule];
+    }
+};
+Policy                                policy;
+
+uint64_t splitmix64_mix (uint64_t z)
+{
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+uint64_t splitmix64_next (uint64_t& state)
+{
+    return splitmix64_mix(state += UINT64_C(0x9e3779b97f4a7c15));
+}
+
+// A pseudo-random permutation of [0, n), computed one index at a time so
+// that a listing can be streamed in shuffled order without materializing it.
+// It's a small Feistel network over the smallest even power of two >= n,
+// cycle-walking until the result lands back inside [0, n).  That's nowhere
+// near every possible permutation, but plenty to shake out order dependence.
+class Permutation {
+    static const int        ROUNDS = 4;
+
+    uint64_t                n;
+    unsigned int        half_bits{1};
+    uint64_t                half_mask;
+    uint64_t                round_keys[ROUNDS];
+
+    uint64_t encrypt (uint64_t x) const
+    {
+        uint64_t        left = x >> half_bits;
+        uint64_t        right = x & half_mask;
+        for (int r = 0; r < ROUNDS; ++r) {
+            const uint64_t        next = left ^ (splitmix64_mix(right ^ round_keys[r]) & half_mask);
+            left = right;
+            right = next;
+        }
+        return left << half_bits | right;
+    }
+
+public:
+    Permutation (uint64_t n, uint64_t key) : n(n)
+    {
+        while ((UINT64_C(1) << (2 * half_bits)) < n) {
+            ++half_bits;
+        }
+        half_mask = (UINT64_C(1) << half_bits) - 1;
+        for (int r = 0; r < ROUNDS; ++r) {
+            round_keys[r] = splitmix64_next(key);
+        }
+    }
+
+    uint64_t operator() (uint64_t i) const
+    {
+        // The domain is less than 4n, so this takes fewer than 4 tries on average
+        do {
+            i = encrypt(i);
+        } while (i >= n);
+        return i;
+    }
+};
+
+// Picks the key for the next shuffle: derived from --shuffle-seed if given,
+// so every pass over every directory is shuffled the same way, otherwise
+// drawn from a per-thread generator seeded once from std::random_device.
+uint64_t next_shuffle_key ()
+{
+    const Disorderfs_config&        c = this_mount().config;
+    if (c.shuffle_seeded) {
+        return splitmix64_mix(static_cast<uint64_t>(static_cast<unsigned int>(c.shuffle_seed)));
+    }
+    static thread_local uint64_t        state = (static_cast<uint64_t>(std::random_device()()) << 32) ^ std::random_device()();
+    return splitmix64_next(state);
+}
+
+// What an open directory's fuse_file_info::fh points to: how to order the
+// directory; the listing, which may be shared with other handles open on the
+// same directory or through the listing cache; and, when shuffling, the key
+// of this handle's current permutation of it.  The listing itself is never
+// modified, so concurrent readers are fine.  A passthrough directory has no
+// listing, and is read from the underlying directory as the kernel asks for
+// its entries.
+//
+// With --listing-memory, the handle also keeps the directory open, so that
+// it can read the listing again after Listing_budget has taken it away.
+struct Dir_handle {
+    Ordering                        ordering;
+    std::mutex                        mutex;                // guards listing
+    std::shared_ptr<const Dirents>        listing;
+    std::mutex                        reload_mutex;        // held while reading the listing again
+    DIR*                                dir{nullptr};
+    int                                fd{-1};
+    std::atomic<uint64_t>                shuffle_key{0};
+
+    // Guarded by Listing_budget
+    bool                                in_lru{false};
+    std::list<Dir_handle*>::iterator        lru_position;
+
+    explicit Dir_handle (const Ordering& ordering) : ordering(ordering) { }
+    ~Dir_handle ()
+    {
+        if (dir) {
+            closedir(dir);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    Dir_handle (const Dir_handle&) = delete;
+    Dir_handle& operator= (const Dir_handle&) = delete;
+
+    void shuffle ()
+    {
+        shuffle_key = next_shuffle_key();
+    }
+
+    std::shared_ptr<const Dirents> get_listing ()
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        return listing;
+    }
+    void set_listing (std::shared_ptr<const Dirents> new_listing)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        listing = std::move(new_listing);
+    }
+};
+
+// Bounds on the getdents64 buffer, which is otherwise sized from the
+// directory's st_size, an estimate of the space its entries take up
+const size_t MIN_GETDENTS_BUFFER = 64 << 10;
+const size_t MAX_GETDENTS_BUFFER = 1 << 20;
+
+// Reads the entries of the directory open on fd straight into dirents, so
+// that big directories take a handful of syscalls, not one per 32 KiB.
+// Returns 0 or -errno.
+int read_dirents (int fd, Dirents& dirents)
+{
+    static thread_local std::vector<char>        buffer;
+    struct stat                                st;
+    size_t                                        wanted = MIN_GETDENTS_BUFFER;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        wanted = std::max(wanted, std::min(MAX_GETDENTS_BUFFER, static_cast<size_t>(st.st_size)));
+    }
+    if (buffer.size() < wanted) {
+        buffer.resize(wanted);
+    }
+    for (;;) {
+        const long        len = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+        if (len == -1) {
+            return -errno;
+        }
+        if (len == 0) {
+            return 0;
+        }
+        for (long pos = 0; pos < len; ) {
+            // struct dirent64 has the kernel's layout, except that d_name is
+            // only as long as the name in each record
+            const struct dirent64*        dirent_p = reinterpret_cast<const struct dirent64*>(buffer.data() + pos);
+            dirents.add(dirent_p->d_name, dirent_p->d_ino, dirent_p->d_type);
+            pos += dirent_p->d_reclen;
+        }
+    }
+}
+
+// Reads and orders the listing of the directory open on fd, taking ownership
+// of fd.  Returns 0 or -errno.
+//
+// Each phase ends with a USDT probe, all taking fd and the number of entries:
+// disorderfs:listing__start(fd), then listing__read, listing__ctime (only
+// when sorting by ctime) and listing__ordered.
+int read_listing (int fd, const Ordering& ordering, std::shared_ptr<const Dirents>& listing)
+{
+    std::shared_ptr<Dirents> dirents{std::make_shared<Dirents>()};
+    DTRACE_PROBE1(disorderfs, listing__start, fd);
+    uint64_t        start = metrics_enabled() ? monotonic_ns() : 0;
+    if (const int res = read_dirents(fd, *dirents)) {
+        close(fd);
+        return res;
+    }
+    DTRACE_PROBE2(disorderfs, listing__read, fd, dirents->size());
+    if (metrics_enabled()) {
+        Thread_stats& stats = thread_stats();
+        const uint64_t now = monotonic_ns();
+        stats.listing_entries.add(dirents->size());
+        stats.listing_read_ns.add(now - start);
+        start = now;
+    }
+    if (ordering.sort) {
+        if (ordering.sort_by_ctime) {
+            ctime_pool.set_sort_keys(*dirents, fd);
+            DTRACE_PROBE2(disorderfs, listing__ctime, fd, dirents->size());
+            if (metrics_enabled()) {
+                const uint64_t now = monotonic_ns();
+                thread_stats().listing_ctime_ns.add(now - start);
+                start = now;
+            }
+            dirents->sort_by_key();
+        } else {
+            // sort lexicographically
+            dirents->sort_by_name();
+        }
+    }
+    if (ordering.reverse) {
+        dirents->reverse();
+    }
+    DTRACE_PROBE2(disorderfs, listing__ordered, fd, dirents->size());
+    if (metrics_enabled()) {
+        thread_stats().listing_sort_ns.add(monotonic_ns() - start);
+    }
+    if (close(fd) == -1) {
+        return -errno;
+    }
+    dirents->account();
+    listing = std::move(dirents);
+    return 0;
+}
+
+// Gets the listing of the directory open on fd, ordered as given: from the
+// listing cache or another open handle if either has it, or else by reading
+// it.  Takes ownership of fd.  Returns 0 or -errno.
+int get_listing (int fd, const Ordering& ordering, std::shared_ptr<const Dirents>& listing)
+{
+    // The FUSE 3 backend also leaves deterministic listings in the kernel's
+    // page cache with cache_readdir (see opendir); libfuse 2 has no
+    // cache_readdir bit, so there --listing-cache at least saves rereading
+    // and resorting.
+    //
+    // Sorting by ctime depends on the entries' ctimes, which can change
+    // without the directory itself changing, so those can't be reused
+    struct stat                        st;
+    if ((ordering.sort && ordering.sort_by_ctime) || fstat(fd, &st) == -1) {
+        return read_listing(fd, ordering, listing);
+    }
+    if ((listing_cache.enabled() && (listing = listing_cache.find(st, ordering))) ||
+        (listing = open_listings.find(st, ordering))) {
+        close(fd);
+        return 0;
+    }
+    if (const int res = read_listing(fd, ordering, listing)) {
+        return res;
+    }
+    if (listing_cache.enabled()) {
+        listing_cache.insert(st, ordering, listing);
+    }
+    open_listings.insert(st, ordering, listing);
+    return 0;
+}
+
+// Keeps the listings held by open handles within --listing-memory.  When
+// over budget, the handles read from least recently give up their listings,
+// and read them again if they're ever read from again.  Listings that are
+// still shared with other handles aren't freed by this, so eviction carries
+// on down the list until enough memory is.  Listings in the listing cache
+// stay in memory whatever the handles do, and have --listing-cache to bound
+// them, so they neither count towards the budget nor get taken away.
+class Listing_budget {
+    size_t                        capacity{0};        // bytes
+    std::mutex                        mutex;
+    std::list<Dir_handle*>        lru;                // handles holding a listing
+
+    static size_t memory ()
+    {
+        const size_t                total = listing_memory.load(std::memory_order_relaxed);
+        const size_t                cached = listing_cache.memory();
+        return total > cached ? total - cached : 0;
+    }
+
+public:
+    void set_capacity (size_t new_capacity) { capacity = new_capacity; }
+    bool enabled () const { return capacity > 0; }
+
+    // Called whenever handle has been read from
+    void touch (Dir_handle& handle)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        if (handle.in_lru) {
+            lru.splice(lru.begin(), lru, handle.lru_position);
+        } else {
+            lru.push_front(&handle);
+            handle.lru_position = lru.begin();
+            handle.in_lru = true;
+        }
+        for (auto it = lru.end(); memory() > capacity && it != lru.begin(); ) {
+            Dir_handle*                victim = *--it;
+            if (victim == &handle) {
+                continue;
+            }
+            const std::shared_ptr<const Dirents> listing = victim->get_listing();
+            if (listing && listing_cache.contains(*listing)) {
+                continue;
+            }
+            victim->set_listing(nullptr);
+            victim->in_lru = false;
+            it = lru.erase(it);
+            listing_evictions.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    void remove (Dir_handle& handle)
+    {
+        std::lock_guard<std::mutex>        lock(mutex);
+        if (handle.in_lru) {
+            lru.erase(handle.lru_position);
+            handle.in_lru = false;
+        }
+    }
+};
+Listing_budget                        listing_budget;
+
+// Switches the current thread to the credentials of the process making the
+// request, or back to root for a mount without --multi-user=yes, which
+// another mount's requests may have left the thread without.  Deliberately
+// doesn't switch back on destruction; see Thread_credentials.
+struct Guard {
+    Guard ()
+    {
+        if (getuid() != 0) {
+            return;
+        }
+        if (this_mount().config.multi_user) {
+            drop_privileges();
+        } else if (thread_credentials.dropped || !thread_credentials.known) {
+            restore_privileges();
+        }
+    }
+};
+
+// Switches the current thread back to root, if a Guard left it with some
+// requester's credentials (or it started with its creator's), for operations
+// on files that are already open.  Those don't check permissions, but run as
+// the thread does: a write as anyone else would clear setuid bits that a
+// write as root keeps, and couldn't use the blocks reserved for root.
+struct As_root {
+    As_root ()
+    {
+        if (getuid() == 0 && (thread_credentials.dropped || !thread_credentials.known)) {
+            restore_privileges();
+        }
+    }
+};
+
+// Who the current request's attribute reads are done as, for the xattr
+// cache: with --multi-user=yes, the requester, though their groups are only
+// known once a Guard has looked them up (returns false until then), and
+// otherwise disorderfs itself
+bool xattr_requester (Xattr_cache::Reader& reader)
+{
+    if (getuid() != 0 || !this_mount().config.multi_user) {
+        reader = Xattr_cache::Reader{0, 0, nullptr};
+        return true;
+    }
+    const struct fuse_context*        ctx = fuse_get_context();
+    std::shared_ptr<const std::vector<gid_t>>        groups(groups_cache.find(ctx));
+    if (!groups) {
+        return false;
+    }
+    reader = Xattr_cache::Reader{ctx->uid, ctx->gid, std::move(groups)};
+    return true;
+}
+
+// Who the current thread reads attributes as, once a Guard has switched it
+Xattr_cache::Reader xattr_reader ()
+{
+    const Thread_credentials&        current = thread_credentials;
+    if (!current.dropped) {
+        return Xattr_cache::Reader{0, 0, nullptr};
+    }
+    return Xattr_cache::Reader{current.uid, current.gid, current.groups};
+}
+
+template<class T> void set_fuse_data (struct fuse_file_info* fi, T data)
+{
+    static_assert(sizeof(data) <= sizeof(fi->fh),
+                  "fuse_file_info::fh too small to store data");
+    std::memcpy(&fi->fh, &data, sizeof(data));
+}
+
+template<class T> T get_fuse_data (struct fuse_file_info* fi)
+{
+    T data;
+    static_assert(sizeof(data) <= sizeof(fi->fh),
+                  "fuse_file_info::fh too small to store data");
+    std::memcpy(&data, &fi->fh, sizeof(data));
+    return data;
+}
+
+// Sets up a handle on the directory open on fd, which it takes ownership
+// of, ordered as given.  Returns 0 or -errno.
+int open_dir_handle (int fd, const Ordering& ordering, std::unique_ptr<Dir_handle>& handle)
+{
+    handle.reset(new Dir_handle(ordering));
+    if (handle->ordering.passthrough) {
+        if (!(handle->dir = fdopendir(fd))) {
+            const int saved_errno = errno;
+            close(fd);
+            return -saved_errno;
+        }
+        return 0;
+    }
+    if (listing_budget.enabled() && (handle->fd = dup(fd)) == -1) {
+        const int saved_errno = errno;
+        close(fd);
+        return -saved_errno;
+    }
+    if (const int res = get_listing(fd, handle->ordering, handle->listing)) {
+        return res;
+    }
+    if (listing_budget.enabled()) {
+        listing_budget.touch(*handle);
+    }
+    return 0;
+}
+
+// The listing to read a handle from at offset: its own, or, if it was given
+// up to stay within --listing-memory, the directory's listing read again.
+// Returns 0 or -errno.
+int handle_listing (Dir_handle& handle, off_t offset, std::shared_ptr<const Dirents>& listing)
+{
+    listing = handle.get_listing();
+    std::unique_lock<std::mutex>        reload_lock;
+    if (!listing) {
+        // Another readdir on the handle may be reading it again already,
+        // and the dups share fd's offset, so only one may at a time
+        reload_lock = std::unique_lock<std::mutex>(handle.reload_mutex);
+        listing = handle.get_listing();
+    }
+    if (!listing) {
+        // Read it again, from the start of the directory
+        Guard g;
+        const int fd = dup(handle.fd);
+        if (fd == -1) {
+            return -errno;
+        }
+        if (lseek(fd, 0, SEEK_SET) == -1) {
+            const int saved_errno = errno;
+            close(fd);
+            return -saved_errno;
+        }
+        if (const int res = get_listing(fd, handle.ordering, listing)) {
+            return res;
+        }
+        handle.set_listing(listing);
+    }
+    if (listing_budget.enabled()) {
+        listing_budget.touch(handle);
+    }
+    // Only shuffle at the start of a pass over the directory, so that
+    // the offsets we hand out stay meaningful for the rest of it
+    if (handle.ordering.shuffle && offset == 0) {
+        handle.shuffle();
+    }
+    return 0;
+}
+
+#if FUSE_USE_VERSION >= 30
+// Looks up name in parent for the kernel, with the mount's padding and
+// timeouts.  Returns 0 or -errno.
+int lookup_entry (Mount& mount, const Inode& parent, const char* name, struct fuse_entry_param& e)
+{
+    std::memset(&e, 0, sizeof(e));
+    if (const int res = mount.inodes.lookup(parent, name, e)) {
+        return res;
+    }
+    e.attr.st_blocks += mount.config.pad_blocks;
+    e.attr_timeout = mount.timeouts.attr;
+    e.entry_timeout = mount.timeouts.entry;
+    return 0;
+}
+
+// A path for the xattr calls to reach the file itself by.  That is its /proc
+// link, for the calls that follow it, except for a symlink, which they would
+// follow past.  As nothing takes both an fd and a symlink, a symlink is
+// reached by its name in its directory instead, with the l*xattr calls.
+// error is -errno if the symlink can't be found there.
+class Xattr_path {
+    int                                dirfd{-1};
+    std::string                        str;
+public:
+    bool                        follow{true};
+    int                                error{0};
+
+    explicit Xattr_path (const Inode& inode)
+    {
+        if (!S_ISLNK(inode.type)) {
+            str = Fd_path(inode.fd, "").c_str();
+            return;
+        }
+        follow = false;
+        char                        buf[PATH_MAX];
+        const ssize_t                len = readlink(Fd_path(inode.fd, "").c_str(), buf, sizeof(buf));
+        if (len <= 0 || static_cast<size_t>(len) == sizeof(buf)) {
+            error = len == -1 ? -errno : -ENAMETOOLONG;
+            return;
+        }
+        const std::string        path(buf, len);
+        const size_t                slash = path.rfind('/');
+        if (slash == std::string::npos) {
+            error = -ENOENT;
+            return;
+        }
+        dirfd = open(slash == 0 ? "/" : path.substr(0, slash).c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (dirfd == -1) {
+            error = -errno;
+            return;
+        }
+        // Once unlinked, or if renamed meanwhile, it isn't there any more
+        const std::string        name = path.substr(slash + 1);
+        struct stat                st;
+        if (fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            error = -errno;
+            return;
+        }
+        if (st.st_dev != inode.dev || st.st_ino != inode.ino) {
+            error = -ENOENT;
+            return;
+        }
+        str = Fd_path(dirfd, name.c_str()).c_str();
+    }
+    ~Xattr_path ()
+    {
+        if (dirfd != -1) {
+            close(dirfd);
+        }
+    }
+    Xattr_path (const Xattr_path&) = delete;
+    Xattr_path& operator= (const Xattr_path&) = delete;
+
+    const char* c_str () const { return str.c_str(); }
+};
+
+// The FUSE path of a directory, for --policy.  The low-level API has no
+// paths, so ask the kernel where the directory is now.  Returns false if
+// it's no longer beneath the mount's root.
+bool inode_path (const Mount& mount, const Inode& inode, std::string& path)
+{
+    char                        buf[PATH_MAX];
+    const ssize_t                len = readlink(Fd_path(inode.fd, "").c_str(), buf, sizeof(buf));
+    if (len <= 0 || static_cast<size_t>(len) == sizeof(buf)) {
+        return false;
+    }
+    path.assign(buf, len);
+    const std::string&        root = mount.root;
+    if (root == "/") {
+        return true;
+    }
+    if (path.compare(0, root.size(), root) != 0 || (path.size() > root.size() && path[root.size()] != '/')) {
+        return false;
+    }
+    path = path.size() == root.size() ? "/" : path.substr(root.size());
+    return true;
+}
+
+// Whether the kernel may keep what it has cached of a file (or, for a
+// directory, its listing, ordered as ordering says) from when it was last
+// opened: only if the file's timestamps and size haven't changed since, by
+// the same rule as the listing cache.  This is what auto_cache does for the
+// high-level API.  Remembers st for the next open.
+bool cache_still_valid (Inode& inode, const struct stat& st, unsigned int ordering = 0)
+{
+    std::lock_guard<std::mutex>        lock(inode.mutex);
+    const bool                        valid = inode.opened && same_time(inode.mtime, st.st_mtim) && same_time(inode.ctime, st.st_ctim) &&
+                                            inode.size == st.st_size && inode.ordering == ordering && timestamps_settled(st);
+    inode.opened = true;
+    inode.mtime = st.st_mtim;
+    inode.ctime = st.st_ctim;
+    inode.size = st.st_size;
+    inode.ordering = ordering;
+    return valid;
+}
+
+// Fills buf with entries of the directory open as handle, from offset on,
+// until it is full: as readdir does, or with plus, as readdirplus does, which
+// looks each one up as well.  Returns the bytes used, or -errno.
+int fill_dir (fuse_req_t req, Mount& mount, const Inode& dir, Dir_handle& handle, off_t offset, char* buf, size_t size, bool plus)
+{
+    size_t                        used = 0;
+    // Returns false, having added nothing, if the entry doesn't fit
+    auto add = [&] (const char* name, ino_t ino, unsigned char type, off_t next) -> bool {
+        struct fuse_entry_param        e;
+        bool                        looked_up = false;
+        if (plus && std::strcmp(name, ".") != 0 && std::strcmp(name, "..") != 0) {
+            looked_up = lookup_entry(mount, dir, name, e) == 0;
+        }
+        if (!looked_up) {
+            // For readdirplus, an entry without an inode only names a file
+            std::memset(&e, 0, sizeof(e));
+            e.attr.st_ino = ino;
+            // Passing on the file type saves find and friends from having
+            // to stat every entry just to learn what it is
+            e.attr.st_mode = DTTOIF(type);
+        }
+        const size_t                len = plus ? fuse_add_direntry_plus(req, buf + used, size - used, name, &e, next)
+                                           : fuse_add_direntry(req, buf + used, size - used, name, &e.attr, next);
+        if (len > size - used) {
+            if (looked_up) {
+                mount.inodes.forget(e.ino, 1);
+            }
+            return false;
+        }
+        used += len;
+        return true;
+    };
+
+    if (handle.dir) {
+        // offset is a telldir position, as handed out below
+        if (offset != telldir(handle.dir)) {
+            seekdir(handle.dir, offset);
+        }
+        for (;;) {
+            errno = 0;
+            const struct dirent*        dirent_p = readdir(handle.dir);
+            if (!dirent_p) {
+                return errno && used == 0 ? -errno : used;
+            }
+            if (!add(dirent_p->d_name, dirent_p->d_ino, dirent_p->d_type, telldir(handle.dir))) {
+                return used;
+            }
+        }
+    }
+    std::shared_ptr<const Dirents> listing;
+    if (const int res = handle_listing(handle, offset, listing)) {
+        return res;
+    }
+    const Dirents&                dirents = *listing;
+    const Permutation                shuffled(dirents.size(), handle.shuffle_key);
+
+    // offset is the index of the next entry to return.  When the buffer
+    // fills up, stop; the kernel will come back for the rest.
+    for (size_t i = offset; i < dirents.size(); ++i) {
+        const Dirents::Entry&        entry = dirents[handle.ordering.shuffle ? shuffled(i) : i];
+        if (!add(dirents.name(entry), entry.ino, entry.type, i + 1)) {
+            break;
+        }
+    }
+    return used;
+}
+
+// size bytes of the file open as fd, at pos.  (FUSE_BUFVEC_INIT is a C
+// compound literal.)
+struct fuse_bufvec fd_bufvec (int fd, size_t size, off_t pos)
+{
+    struct fuse_bufvec                bufv;
+    std::memset(&bufv, 0, sizeof(bufv));
+    bufv.count = 1;
+    bufv.buf[0].size = size;
+    bufv.buf[0].flags = static_cast<fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    bufv.buf[0].fd = fd;
+    bufv.buf[0].pos = pos;
+    return bufv;
+}
+
+// Replies to mknod, mkdir, symlink or link, which made name in dir if res is
+// 0, with the entry for it
+void reply_made (Request& r, Mount& mount, const Inode& dir, const char* name, int res)
+{
+    struct fuse_entry_param        e;
+    if (res == 0) {
+        res = lookup_entry(mount, dir, name, e);
+    }
+    if (res != 0) {
+        return r.reply_err(res);
+    }
+    r.reply_entry(e);
+}
+
+// The flags to open an underlying file with, for an open with flags.  With
+// --io=writeback the kernel reads in pages to fill the rest of a partly
+// written one, even from a file opened write-only, and works out where
+// appends go itself.
+int open_flags (const Mount& mount, int flags)
+{
+    if (mount.config.io == IO_WRITEBACK) {
+        if ((flags & O_ACCMODE) == O_WRONLY) {
+            flags = (flags & ~O_ACCMODE) | O_RDWR;
+        }
+        flags &= ~O_APPEND;
+    }
+    return flags | O_CLOEXEC;
+}
+
+// Fills in fi for the underlying file open as fd: with --cache=relaxed, the
+// kernel keeps the file's pages from one open to the next unless it has
+// changed, and with --io=passthrough, reads and writes go straight to fd.
+void open_file (fuse_req_t req, Mount& mount, Inode& inode, int fd, struct fuse_file_info* fi)
+{
+    fi->fh = fd;
+    if (mount.config.cache == CACHE_RELAXED) {
+        struct stat                st;
+        fi->keep_cache = fstat(fd, &st) == 0 && cache_still_valid(inode, st);
+    }
+#ifdef FUSE_CAP_PASSTHROUGH
+    if (mount.config.io == IO_PASSTHROUGH && S_ISREG(inode.type)) {
+        // One backing file serves every open of the inode, so that they
+        // all share the underlying page cache
+        std::lock_guard<std::mutex>        lock(inode.mutex);
+        if (inode.backing_id == 0) {
+            // Registering a backing file takes CAP_SYS_ADMIN, which a Guard
+            // for --multi-user=yes has left us without
+            As_root                        root;
+            const int                id = fuse_passthrough_open(req, fd);
+            const int                saved_errno = errno;
+            // Don't keep trying, if the kernel won't have it
+            inode.backing_id = id > 0 ? id : -1;
+            static std::atomic<bool>        warned{false};
+            if (id <= 0 && !warned.exchange(true)) {
+                std::cerr << "WARNING: kernel passthrough refused (" << std::strerror(saved_errno) << "), so files are read and written through disorderfs" << std::endl;
+            }
+        }
+        if (inode.backing_id > 0) {
+            fi->backing_id = inode.backing_id;
+            ++inode.backing_users;
+        }
+    }
+#endif
+}
+
+// Undoes open_file, once the file is released
+void release_file (fuse_req_t req, Inode& inode)
+{
+#ifdef FUSE_CAP_PASSTHROUGH
+    std::lock_guard<std::mutex>        lock(inode.mutex);
+    if (inode.backing_id > 0 && inode.backing_users > 0 && --inode.backing_users == 0) {
+        fuse_passthrough_close(req, inode.backing_id);
+        inode.backing_id = 0;
+    }
+#endif
+}
+
+typedef struct fuse_lowlevel_ops        Fuse_operations;
+#else
+// The file path leads to, for the xattr cache: as getattr last found it, or
+// else as found now.  Returns false if there's no such file.
+bool xattr_inode (Mount& mount, const char* path, dev_t& dev, ino_t& ino)
+{
+    if (mount.xattr_cache.find_inode(path, dev, ino)) {
+        return true;
+    }
+    const At_path                p(path);
+    struct stat                        st;
+    if (fstatat(p.fd, p.name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return false;
+    }
+    mount.xattr_cache.set_inode(path, st);
+    dev = st.st_dev;
+    ino = st.st_ino;
+    return true;
+}
+
+// Forgets the attributes of the file at path, which have changed
+void forget_xattrs (Mount& mount, const char* path)
+{
+    dev_t                        dev;
+    ino_t                        ino;
+    if (mount.xattr_cache.enabled() && xattr_inode(mount, path, dev, ino)) {
+        mount.xattr_cache.invalidate(dev, ino);
+    }
+}
+
+typedef struct fuse_operations                Fuse_operations;
+#endif
+Fuse_operations                        disorderfs_fuse_operations;
+enum {
+    KEY_HELP,
+    KEY_VERSION,
+    KEY_QUIET,
+    KEY_STATS_FILE,
+    KEY_POLICY_FILE,
+    KEY_TRACE_FILE,
+    KEY_RECORD_FILE,
+    KEY_MOUNTS_FILE
+};
+#define DISORDERFS_OPT(t, p, v) { t, offsetof(Disorderfs_config, p), v }
+const struct fuse_opt disorderfs_fuse_opts[] = {
+    DISORDERFS_OPT("--multi-user=no", multi_user, false),
+    DISORDERFS_OPT("--multi-user=yes", multi_user, true),
+    DISORDERFS_OPT("--shuffle-dirents=no", shuffle_dirents, false),
+    DISORDERFS_OPT("--shuffle-dirents=yes", shuffle_dirents, true),
+    DISORDERFS_OPT("--shuffle-seed=%i", shuffle_seed, 0),
+    DISORDERFS_OPT("--shuffle-seed=", shuffle_seeded, true),
+    DISORDERFS_OPT("--reverse-dirents=no", reverse_dirents, false),
+    DISORDERFS_OPT("--reverse-dirents=yes", reverse_dirents, true),
+    DISORDERFS_OPT("--sort-dirents=no", sort_dirents, false),
+    DISORDERFS_OPT("--sort-dirents=yes", sort_dirents, true),
+    DISORDERFS_OPT("--pad-blocks=%i", pad_blocks, 0),
+    DISORDERFS_OPT("--share-locks=no", share_locks, false),
+    DISORDERFS_OPT("--share-locks=yes", share_locks, true),
+    DISORDERFS_OPT("--sort-by-ctime=no", sort_by_ctime, false),
+    DISORDERFS_OPT("--sort-by-ctime=yes", sort_by_ctime, true),
+    DISORDERFS_OPT("--dirfd-cache=%i", dirfd_cache, 0),
+    DISORDERFS_OPT("--listing-cache=%i", listing_cache, 0),
+    DISORDERFS_OPT("--listing-memory=%i", listing_memory, 0),
+    DISORDERFS_OPT("--trace-buffer=%i", trace_buffer, 0),
+    DISORDERFS_OPT("--negative-cache=%i", negative_cache, 0),
+    DISORDERFS_OPT("--xattr-cache=%i", xattr_cache, 0),
+    DISORDERFS_OPT("--security-xattrs=no", security_xattrs, false),
+    DISORDERFS_OPT("--security-xattrs=yes", security_xattrs, true),
+    DISORDERFS_OPT("--ctime-threads=%i", ctime_threads, 0),
+    DISORDERFS_OPT("--cache=strict", cache, CACHE_STRICT),
+    DISORDERFS_OPT("--cache=default", cache, CACHE_DEFAULT),
+    DISORDERFS_OPT("--cache=relaxed", cache, CACHE_RELAXED),
+    DISORDERFS_OPT("--io=default", io, IO_DEFAULT),
+    DISORDERFS_OPT("--io=throughput", io, IO_THROUGHPUT),
+    DISORDERFS_OPT("--io=writeback", io, IO_WRITEBACK),
+    DISORDERFS_OPT("--io=passthrough", io, IO_PASSTHROUGH),
+    DISORDERFS_OPT("--min-threads=%i", min_threads, 0),
+    DISORDERFS_OPT("--max-threads=%i", max_threads, 0),
+    DISORDERFS_OPT("--ready-fd=%i", ready_fd, 0),
+    FUSE_OPT_KEY("-h", KEY_HELP),
+    FUSE_OPT_KEY("--help", KEY_HELP),
+    FUSE_OPT_KEY("-V", KEY_VERSION),
+    FUSE_OPT_KEY("--version", KEY_VERSION),
+    FUSE_OPT_KEY("-q", KEY_QUIET),
+    FUSE_OPT_KEY("--quiet", KEY_QUIET),
+    FUSE_OPT_KEY("--stats-file=", KEY_STATS_FILE),
+    FUSE_OPT_KEY("--policy=", KEY_POLICY_FILE),
+    FUSE_OPT_KEY("--trace-file=", KEY_TRACE_FILE),
+    FUSE_OPT_KEY("--record=", KEY_RECORD_FILE),
+    FUSE_OPT_KEY("--mounts=", KEY_MOUNTS_FILE),
+    FUSE_OPT_END
+};
+int fuse_opt_proc (void* data, const char* arg, int key, struct fuse_args* outargs)
+{
+    if (key == FUSE_OPT_KEY_NONOPT) {
+        bare_arguments.emplace_back(arg);
+        return 0;
+    } else if (key == KEY_HELP) {
+        std::clog << "Usage: disorderfs [OPTIONS] ROOTDIR MOUNTPOINT" << std::endl;
+        std::clog << "       disorderfs [OPTIONS] --mounts=FILE" << std::endl;
+        std::clog << "General options:" << std::endl;
+        std::clog << "    -o opt,[opt...]        mount options (see below)" << std::endl;
+        std::clog << "    -h, --help             display help" << std::endl;
+        std::clog << "    -V, --version          display version info" << std::endl;
+        std::clog << "    -q, --quiet            don't output any status messages" << std::endl;
+        std::clog << std::endl;
+        std::clog << "disorderfs options:" << std::endl;
+        std::clog << "    --multi-user=yes|no    allow multiple users to access overlay (requires root; default: no)" << std::endl;
+        std::clog << "    --shuffle-dirents=yes|no  randomly shuffle directory entries? (default: no)" << std::endl;
+        std::clog << "    --shuffle-seed=N       shuffle the same way every time, using seed N" << std::endl;
+        std::clog << "    --reverse-dirents=yes|no  reverse dirent order? (default: yes)" << std::endl;
+        std::clog << "    --sort-dirents=yes|no  sort directory entries instead (default: no)" << std::endl;
+        std::clog << "    --sort-by-ctime=yes|no  sort directory entries by ctime as returned by lstat syscall instead of alphabetically (default: no). No effect if --sort-dirents=no (default). Will show the youngest file first if --reverse-dirents=yes." << std::endl;
+        std::clog << "    --ctime-threads=N      use up to N threads to stat entries for --sort-by-ctime (default: 1)" << std::endl;
+        std::clog << "    --stats-file=FILE      write per-operation metrics to FILE on SIGUSR1" << std::endl;
+        std::clog << "    --trace-file=FILE      write the most recent operations to FILE on SIGUSR2" << std::endl;
+        std::clog << "    --trace-buffer=N       with --trace-file, remember the last N operations (default: 65536)" << std::endl;
+        std::clog << "    --record=FILE          log every operation to FILE, for disorderfs-replay" << std::endl;
+        std::clog << "    --policy=FILE          order directories matching FILE's patterns as it says" << std::endl;
+        std::clog << "    --mounts=FILE          serve every ROOTDIR MOUNTPOINT pair listed in FILE" << std::endl;
+        std::clog << "    --pad-blocks=N         add N to st_blocks (default: 1)" << std::endl;
+        std::clog << "    --share-locks=yes|no   share locks with underlying filesystem (default: no)" << std::endl;
+        std::clog << "    --cache=strict|default|relaxed  how long the kernel may cache metadata (default: default)" << std::endl;
+        std::clog << "    --io=default|throughput|writeback|passthrough  how the kernel should send reads and writes (default: default)" << std::endl;
+        std::clog << "    --dirfd-cache=N        cache up to N parent directory fds (default: 0)" << std::endl;
+        std::clog << "    --listing-cache=N      cache up to N MiB of directory listings (default: 0)" << std::endl;
+        std::clog << "    --listing-memory=N     keep open directories' listings within N MiB (default: 0, no limit)" << std::endl;
+        std::clog << "    --negative-cache=N     remember missing files for N seconds (default: 0)" << std::endl;
+        std::clog << "    --xattr-cache=N        remember extended attributes for N seconds (default: 0)" << std::endl;
+        std::clog << "    --security-xattrs=yes|no  whether the underlying filesystem has security.* attributes (default: yes)" << std::endl;
+        std::clog << "    --min-threads=N        keep at least N threads serving requests (default: 1)" << std::endl;
+        std::clog << "    --max-threads=N        never use more than N threads serving requests (default: no limit)" << std::endl;
+        std::clog << "    --ready-fd=N           write a newline to fd N once mounted" << std::endl;
+        std::clog << std::endl;
+#if FUSE_USE_VERSION >= 30
+        std::clog << "FUSE options:" << std::endl;
+        fuse_cmdline_help();
+        fuse_lowlevel_help();
+#else
+        fuse_opt_add_arg(outargs, "-ho");
+        fuse_main(outargs->argc, outargs->argv, &disorderfs_fuse_operations, nullptr);
+#endif
+        std::exit(0);
+    } else if (key == KEY_VERSION) {
+        std::cout << "disorderfs version: " DISORDERFS_VERSION << std::endl;
+#if FUSE_USE_VERSION >= 30
+        std::cout << "FUSE library version " << fuse_pkgversion() << std::endl;
+        fuse_lowlevel_version();
+#else
+        fuse_opt_add_arg(outargs, "--version");
+        fuse_main(outargs->argc, outargs->argv, &disorderfs_fuse_operations, nullptr);
+#endif
+        std::exit(0);
+    } else if (key == KEY_QUIET) {
+        config.quiet = true;
+        return 0;
+    } else if (key == KEY_STATS_FILE) {
+        stats_file = std::strchr(arg, '=') + 1;
+        return 0;
+    } else if (key == KEY_POLICY_FILE) {
+        policy_file = std::strchr(arg, '=') + 1;
+        return 0;
+    } else if (key == KEY_TRACE_FILE) {
+        trace_file = std::strchr(arg, '=') + 1;
+        return 0;
+    } else if (key == KEY_RECORD_FILE) {
+        record_file = std::strchr(arg, '=') + 1;
+        return 0;
+    } else if (key == KEY_MOUNTS_FILE) {
+        mounts_file = std::strchr(arg, '=') + 1;
+        return 0;
+    }
+    return 1;
+}
+
+// Options that size what every mount shares, so a line of the --mounts file
+// can't change them
+const std::pair<const char*, int Disorderfs_config::*> daemon_options[] = {
+    {"--share-locks", &Disorderfs_config::share_locks},
+    {"--listing-cache", &Disorderfs_config::listing_cache},
+    {"--listing-memory", &Disorderfs_config::listing_memory},
+    {"--trace-buffer", &Disorderfs_config::trace_buffer},
+    {"--ctime-threads", &Disorderfs_config::ctime_threads},
+    {"--min-threads", &Disorderfs_config::min_threads},
+    {"--max-threads", &Disorderfs_config::max_threads},
+    {"--ready-fd", &Disorderfs_config::ready_fd},
+};
+std::string                        mount_opt_error;
+
+// Parses the options on a line of the --mounts file: disorderfs options go to
+// the mount's config, and anything else (-o in particular) is kept for FUSE
+int mount_opt_proc (void* data, const char* arg, int key, struct fuse_args* outargs)
+{
+    if (key == FUSE_OPT_KEY_NONOPT) {
+        mount_opt_error = std::string("unexpected argument '") + arg + "'";
+        return -1;
+    } else if (key != FUSE_OPT_KEY_OPT) {
+        mount_opt_error = std::string(arg) + " can only be given on the command line";
+        return -1;
+    }
+    return 1;
+}
+
+// Reads the --mounts file: a ROOTDIR and MOUNTPOINT per line, separated by
+// whitespace and optionally followed by that mount's own options, which
+// override the command line's.  Returns an empty string on success, or else
+// what was wrong with the file.
+std::string load_mounts (const std::string& path)
+{
+    std::ifstream                file(path);
+    if (!file) {
+        return std::strerror(errno);
+    }
+    std::string                        line;
+    for (int lineno = 1; std::getline(file, line); ++lineno) {
+        const size_t                start = line.find_first_not_of(" \t");
+        if (start == std::string::npos || line[start] == '#') {
+            continue;
+        }
+        std::istringstream        words(line);
+        std::vector<std::string>        argv{"disorderfs"};
+        std::string                        word;
+        while (words >> word) {
+            argv.push_back(word);
+        }
+        if (argv.size() < 3) {
+            return "line " + std::to_string(lineno) + ": missing MOUNTPOINT";
+        }
+        mounts.emplace_back();
+        Mount&                        mount = mounts.back();
+        mount.root = argv[1];
+        mount.mountpoint = argv[2];
+        mount.config = config;
+
+        std::vector<char*>        options{&argv[0][0]};
+        for (size_t i = 3; i < argv.size(); ++i) {
+            options.push_back(&argv[i][0]);
+        }
+        struct fuse_args        margs = FUSE_ARGS_INIT(static_cast<int>(options.size()), options.data());
+        if (fuse_opt_parse(&margs, &mount.config, disorderfs_fuse_opts, mount_opt_proc) == -1) {
+            fuse_opt_free_args(&margs);
+            return "line " + std::to_string(lineno) + ": " + (mount_opt_error.empty() ? "invalid options" : mount_opt_error);
+        }
+        mount.fuse_options.assign(margs.argv + 1, margs.argv + margs.argc);
+        fuse_opt_free_args(&margs);
+        for (const auto& option : daemon_options) {
+            if (mount.config.*option.second != config.*option.second) {
+                return "line " + std::to_string(lineno) + ": " + option.first + " applies to every mount, so it can only be given on the command line";
+            }
+        }
+    }
+    if (file.bad()) {
+        return std::strerror(errno);
+    }
+    if (mounts.empty()) {
+        return "no mounts";
+    }
+    return "";
+}
+
+// Opens the mount's root, and sets up the caches it has to itself.  Returns
+// false if root can't be opened.
+bool open_root (Mount& mount)
+{
+    if (char* resolved_path = realpath(mount.root.c_str(), nullptr)) {
+        mount.root = resolved_path;
+        std::free(resolved_path);
+    } else {
+        std::perror(mount.root.c_str());
+        return false;
+    }
+    // As fuse_parse_cmdline would, so that the mountpoint can still be
+    // unmounted after fuse_daemonize has changed directory
+    if (char* resolved_path = realpath(mount.mountpoint.c_str(), nullptr)) {
+        mount.mountpoint = resolved_path;
+        std::free(resolved_path);
+    } else {
+        std::perror(mount.mountpoint.c_str());
+        return false;
+    }
+
+    // Open root once, so that every operation can be resolved relative to it
+    mount.root_fd = open(mount.root.c_str(), O_PATH | O_DIRECTORY);
+    if (mount.root_fd == -1) {
+        std::perror(mount.root.c_str());
+        return false;
+    }
+    if (mount.config.dirfd_cache > 0) {
+        mount.dirfd_cache.set_capacity(mount.config.dirfd_cache);
+    }
+    if (mount.config.negative_cache > 0) {
+        mount.negative_cache.set_ttl(mount.config.negative_cache);
+    }
+    if (mount.config.xattr_cache > 0) {
+        mount.xattr_cache.set_ttl(mount.config.xattr_cache);
+    }
+#if FUSE_USE_VERSION >= 30
+    if (!mount.inodes.set_root(mount.root_fd)) {
+        std::perror(mount.root.c_str());
+        return false;
+    }
+    // Given as --cache's profiles do for the high-level API; see serve
+    if (mount.config.cache == CACHE_STRICT) {
+        mount.timeouts = Timeouts{0, 0, 0};
+    } else if (mount.config.cache == CACHE_RELAXED) {
+        mount.timeouts = Timeouts{30, 30, 5};
+    } else {
+        mount.timeouts = Timeouts{1, 1, 0};
+    }
+    // Missing files are remembered by the kernel, as negative entries
+    mount.timeouts.negative = std::max<double>(mount.timeouts.negative, mount.config.negative_cache);
+#endif
+    return true;
+}
+
+#if FUSE_USE_VERSION >= 30
+// Adds the FUSE options that follow from a mount's config.  The low-level
+// API takes the rest of what the high-level one gets as options in other
+// ways: the kernel caching timeouts in each reply, and the I/O settings in
+// init.
+void add_mount_options (struct fuse_args* args, const Disorderfs_config& c)
+{
+    fuse_opt_add_arg(args, "-o");
+    fuse_opt_add_arg(args, "default_permissions");
+    if (c.multi_user) {
+        fuse_opt_add_arg(args, "-o");
+        fuse_opt_add_arg(args, "allow_other");
+    }
+}
+
+// The kernel caching timeouts, which the low-level API leaves to us, but
+// which can still be given with -o as for the high-level API
+#define DISORDERFS_TIMEOUT(t, p) { t, offsetof(Timeouts, p), 0 }
+const struct fuse_opt timeout_opts[] = {
+    DISORDERFS_TIMEOUT("attr_timeout=%lf", attr),
+    DISORDERFS_TIMEOUT("entry_timeout=%lf", entry),
+    DISORDERFS_TIMEOUT("negative_timeout=%lf", negative),
+    FUSE_OPT_END
+};
+#else
+// Adds the FUSE options that follow from a mount's config
+void add_mount_options (struct fuse_args* args, const Disorderfs_config& c)
+{
+    // Kernel caching timeouts go in front of the user's own options, so that
+    // any timeouts given explicitly with -o still win
+    if (c.cache == CACHE_STRICT) {
+        fuse_opt_insert_arg(args, 1, "-o");
+        fuse_opt_insert_arg(args, 2, "attr_timeout=0,entry_timeout=0,negative_timeout=0");
+    } else if (c.cache == CACHE_RELAXED) {
+        fuse_opt_insert_arg(args, 1, "-o");
+        fuse_opt_insert_arg(args, 2, "attr_timeout=30,entry_timeout=30,negative_timeout=5,auto_cache");
+    }
+    // Without max_pages (only the FUSE 3 backend can ask for it), 128 KiB is
+    // the largest request the kernel will send; splicing lets read_buf and
+    // write_buf move the data between the kernel and the underlying files
+    // without copying it
+    if (c.io == IO_THROUGHPUT) {
+        fuse_opt_insert_arg(args, 1, "-o");
+        fuse_opt_insert_arg(args, 2, "big_writes,max_write=131072,max_read=131072,async_read,splice_read,splice_write,splice_move");
+    }
+
+    // Add some of our own hard-coded FUSE options:
+    fuse_opt_add_arg(args, "-o");
+    fuse_opt_add_arg(args, "atomic_o_trunc,default_permissions,use_ino"); // XXX: other mount options?
+    if (c.multi_user) {
+        fuse_opt_add_arg(args, "-o");
+        fuse_opt_add_arg(args, "allow_other");
+    }
+}
+#endif
+
+// The multithreaded request loop.  Like libfuse's own, it starts workers on
+// demand, whenever the last idle one picks up a request, and retires them
+// again once too many are idle; unlike it, the pool can be given a floor of
+// workers started at mount time and a ceiling it will never grow past.
+//
+// With several mounts, the workers serve all of them: each waits in epoll for
+// any channel to have a request, and the channel stays out of epoll (it's
+// EPOLLONESHOT) until its request has been read, so that exactly one worker
+// reads each request.  Unmounting one mount leaves the others served.
+class Worker_pool {
+public:
+    static const size_t        MAX_IDLE_WORKERS = 10;
+
+    struct Session {
+        struct fuse_session*        se;
+#if FUSE_USE_VERSION < 30
+        struct fuse_chan*        ch;
+#endif
+    };
+
+private:
+#if FUSE_USE_VERSION >= 30
+    // A worker's request buffer, which libfuse allocates on the first
+    // request and then reuses, as its own loop does
+    struct Request_buf {
+        struct fuse_buf                buf;
+        Request_buf () { std::memset(&buf, 0, sizeof(buf)); }
+        ~Request_buf () { std::free(buf.mem); }
+        Request_buf (const Request_buf&) = delete;
+        Request_buf& operator= (const Request_buf&) = delete;
+    };
+#endif
+
+    std::vector<Session>        sessions;
+    int                        epoll_fd{-1};        // only with several sessions
+    size_t                        min_workers;
+    size_t                        max_workers; // 0 means no limit
+    std::mutex                mutex;
+    std::vector<pthread_t>        workers;
+    size_t                        idle{0};
+    bool                        stopping{false};
+    int                        error{0};
+    sem_t                        finished;
+
+    static void* worker_main (void* data)
+    {
+        static_cast<Worker_pool*>(data)->work();
+        return nullptr;
+    }
+
+    // Called with mutex held
+    bool start_worker ()
+    {
+        if (stopping || (max_workers && workers.size() >= max_workers)) {
+            return false;
+        }
+        // Workers leave every signal to the main thread, which is the one
+        // waiting for fuse_set_signal_handlers to tell it to exit
+        sigset_t        all_signals, old_signals;
+        sigfillset(&all_signals);
+        pthread_sigmask(SIG_SETMASK, &all_signals, &old_signals);
+        pthread_t        thread;
+        const int        res = pthread_create(&thread, nullptr, worker_main, this);
+        pthread_sigmask(SIG_SETMASK, &old_signals, nullptr);
+        if (res != 0) {
+            std::clog << "disorderfs: error: cannot start worker thread: " << std::strerror(res) << std::endl;
+            return false;
+        }
+        workers.push_back(thread);
+        ++idle;
+        return true;
+    }
+
+    // Called with mutex held; returns false if the caller should keep working
+    bool retire_worker ()
+    {
+        if (stopping || workers.size() <= min_workers || idle <= MAX_IDLE_WORKERS) {
+            return false;
+        }
+        const pthread_t        self = pthread_self();
+        workers.erase(std::find_if(workers.begin(), workers.end(), [self] (pthread_t t) { return pthread_equal(t, self); }));
+        --idle;
+        pthread_detach(self);
+        return true;
+    }
+
+    bool exited () const
+    {
+        return std::all_of(sessions.begin(), sessions.end(), [] (const Session& session) { return fuse_session_exited(session.se); });
+    }
+
+    // Lets a worker pick up the next request from session i
+    int watch (int op, size_t i)
+    {
+        struct epoll_event        event;
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.u64 = i;
+#if FUSE_USE_VERSION >= 30
+        return epoll_ctl(epoll_fd, op, fuse_session_fd(sessions[i].se), &event);
+#else
+        return epoll_ctl(epoll_fd, op, fuse_chan_fd(sessions[i].ch), &event);
+#endif
+    }
+
+    void work ()
+    {
+        // Shutdown cancels workers, but only while they wait for a request
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
+#if FUSE_USE_VERSION >= 30
+        Request_buf                request;
+        struct fuse_buf&        fbuf = request.buf;
+#else
+        size_t                        bufsize = 0;
+        for (const Session& session : sessions) {
+            bufsize = std::max(bufsize, fuse_chan_bufsize(session.ch));
+        }
+        std::vector<char>        mem(bufsize);
+#endif
+        while (!exited()) {
+            size_t                i = 0;
+            if (epoll_fd != -1) {
+                struct epoll_event        event;
+                pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
+                const int        ready = epoll_wait(epoll_fd, &event, 1, -1);
+                pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
+                if (ready <= 0) {
+                    continue;
+                }
+                i = event.data.u64;
+            }
+            const Session&        session = sessions[i];
+#if FUSE_USE_VERSION < 30
+            struct fuse_chan*        tmpch = session.ch;
+            struct fuse_buf                fbuf;
+            std::memset(&fbuf, 0, sizeof(fbuf));
+            fbuf.mem = mem.data();
+            fbuf.size = mem.size();
+#endif
+
+            pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, nullptr);
+#if FUSE_USE_VERSION >= 30
+            const int        res = fuse_session_receive_buf(session.se, &fbuf);
+#else
+            const int        res = fuse_session_receive_buf(session.se, &fbuf, &tmpch);
+#endif
+            pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, nullptr);
+            if (res == -EINTR) {
+                if (epoll_fd != -1) {
+                    watch(EPOLL_CTL_MOD, i);
+                }
+                continue;
+            }
+            if (res <= 0) {
+                // Unmounted, or broken: stop serving this session
+                fuse_session_exit(session.se);
+                if (res < 0) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    error = -1;
+                }
+                sem_post(&finished);
+                continue;
+            }
+            if (epoll_fd != -1) {
+                watch(EPOLL_CTL_MOD, i);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--idle == 0) {
+                    start_worker();
+                }
+            }
+#if FUSE_USE_VERSION >= 30
+            fuse_session_process_buf(session.se, &fbuf);
+#else
+            fuse_session_process_buf(session.se, &fbuf, tmpch);
+#endif
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++idle;
+                if (retire_worker()) {
+                    return;
+                }
+            }
+        }
+        sem_post(&finished);
+    }
+
+public:
+    Worker_pool (std::vector<Session> arg_sessions, size_t arg_min_workers, size_t arg_max_workers)
+    : sessions(std::move(arg_sessions)), min_workers(std::max<size_t>(arg_min_workers, 1)), max_workers(arg_max_workers)
+    {
+        if (max_workers && max_workers < min_workers) {
+            max_workers = min_workers;
+        }
+        sem_init(&finished, 0, 0);
+    }
+    ~Worker_pool ()
+    {
+        sem_destroy(&finished);
+    }
+
+    int run ()
+    {
+        if (sessions.size() > 1) {
+            epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+            for (size_t i = 0; epoll_fd != -1 && i < sessions.size(); ++i) {
+                if (watch(EPOLL_CTL_ADD, i) == -1) {
+                    close(epoll_fd);
+                    epoll_fd = -1;
+                }
+            }
+            if (epoll_fd == -1) {
+                std::perror("disorderfs: epoll");
+                return -1;
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            while (workers.size() < min_workers) {
+                if (!start_worker()) {
+                    error = -1;
+                    break;
+                }
+            }
+        }
+
+        if (error == 0) {
+            // Woken by workers leaving the loop, or by a signal interrupting sem_wait
+            while (!exited()) {
+                sem_wait(&finished);
+            }
+        }
+
+        std::vector<pthread_t>        remaining;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            remaining.swap(workers);
+        }
+        for (pthread_t thread : remaining) {
+            pthread_cancel(thread);
+            pthread_join(thread, nullptr);
+        }
+        for (const Session& session : sessions) {
+            fuse_session_reset(session.se);
+        }
+        if (epoll_fd != -1) {
+            close(epoll_fd);
+        }
+        return error;
+    }
+};
+
+// The sessions to end on SIGHUP, SIGINT and SIGTERM: every mount's, where
+// fuse_set_signal_handlers would only know about one
+#if FUSE_USE_VERSION >= 30
+// With timeouts longer than --cache=default's, the kernel goes on answering
+// from what it has cached of a file, or of a name that was missing, long
+// after the underlying file has changed.  So for such a mount, a thread
+// watches with inotify the directories the kernel knows, and tells the
+// kernel which of its entries and inodes to drop when they change.  Changes
+// made through the mount are seen too, which costs the kernel a lookup.
+class Change_watcher {
+    static const uint32_t        ENTRY_EVENTS = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
+    static const uint32_t        INODE_EVENTS = IN_ATTRIB | IN_CLOSE_WRITE;
+
+    Mount&                        mount;
+    int                                inotify_fd;
+    int                                wake_pipe[2];
+    std::thread                        thread;
+
+    void add_watches ()
+    {
+        const int                res = mount.inodes.add_watches(ENTRY_EVENTS | INODE_EVENTS | IN_ONLYDIR | IN_EXCL_UNLINK);
+        static std::atomic<bool>        warned{false};
+        if (res == -ENOSPC && !warned.exchange(true)) {
+            std::cerr << "WARNING: out of inotify watches (see fs.inotify.max_user_watches), so some directories' changes don't reach the kernel's cache until it times out" << std::endl;
+        }
+    }
+
+    void handle (const struct inotify_event& event)
+    {
+        if (event.mask & IN_Q_OVERFLOW) {
+            for (fuse_ino_t ino : mount.inodes.all()) {
+                fuse_lowlevel_notify_inval_inode(mount.se, ino, 0, 0);
+            }
+            return;
+        }
+        if (event.mask & IN_IGNORED) {
+            mount.inodes.unwatch(event.wd);
+            return;
+        }
+        const char*                name = event.len ? event.name : nullptr;
+        fuse_ino_t                dir;
+        fuse_ino_t                file;
+        if (!mount.inodes.find_watched(event.wd, name, dir, file)) {
+            return;
+        }
+        if (name && (event.mask & ENTRY_EVENTS)) {
+            fuse_lowlevel_notify_inval_entry(mount.se, dir, name, std::strlen(name));
+            fuse_lowlevel_notify_inval_inode(mount.se, dir, 0, 0);
+        } else if (!name) {
+            fuse_lowlevel_notify_inval_inode(mount.se, dir, 0, 0);
+        }
+        if (file) {
+            fuse_lowlevel_notify_inval_inode(mount.se, file, 0, 0);
+        }
+    }
+
+    void run ()
+    {
+        struct pollfd                fds[2] = {{inotify_fd, POLLIN, 0}, {wake_pipe[0], POLLIN, 0}};
+        alignas(struct inotify_event) char        buf[64 * 1024];
+        for (;;) {
+            if (poll(fds, 2, -1) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::perror("disorderfs: inotify");
+                return;
+            }
+            if (fds[1].revents) {
+                // Drained before add_watches, so that no lookup's wake-up is lost
+                const ssize_t        len = read(wake_pipe[0], buf, sizeof(buf));
+                if (len == 0) {
+                    return;                // stopping
+                }
+                add_watches();
+            }
+            if (fds[0].revents) {
+                const ssize_t        len = read(inotify_fd, buf, sizeof(buf));
+                for (ssize_t off = 0; off < len; ) {
+                    const struct inotify_event*        event = reinterpret_cast<const struct inotify_event*>(buf + off);
+                    handle(*event);
+                    off += sizeof(*event) + event->len;
+                }
+            }
+        }
+    }
+
+public:
+    static bool wanted (const Mount& mount)
+    {
+        return mount.timeouts.attr > 1 || mount.timeouts.entry > 1 || mount.timeouts.negative > 0;
+    }
+
+    explicit Change_watcher (Mount& mount) : mount(mount)
+    {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1 || pipe2(wake_pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            std::cerr << "WARNING: cannot watch " << mount.root << " (" << std::strerror(errno) << "), so its changes don't reach the kernel's cache until it times out" << std::endl;
+            if (inotify_fd != -1) {
+                close(inotify_fd);
+                inotify_fd = -1;
+            }
+            return;
+        }
+        mount.inodes.set_watcher(inotify_fd, wake_pipe[1]);
+        add_watches();
+        thread = std::thread(&Change_watcher::run, this);
+    }
+
+    // Returns once the thread has stopped, so before the session goes
+    ~Change_watcher ()
+    {
+        if (inotify_fd == -1) {
+            return;
+        }
+        mount.inodes.set_watcher(-1, -1);
+        close(wake_pipe[1]);
+        thread.join();
+        close(wake_pipe[0]);
+        close(inotify_fd);
+    }
+
+    Change_watcher (const Change_watcher&) = delete;
+    Change_watcher& operator= (const Change_watcher&) = delete;
+};
+
+// The multithreaded loop for a single mount: libfuse's own, which gives each
+// worker its own clone of /dev/fuse (clone_fd), so that they don't all queue
+// on the one descriptor.  It starts workers only on demand, so --min-threads
+// just sets how many it keeps idle.  Before libfuse 3.12 it has no ceiling,
+// so with --max-threads there it's our pool, without clones, that serves.
+int session_loop_mt (const std::vector<Worker_pool::Session>& sessions)
+{
+    const unsigned int                max_idle = std::max<size_t>(Worker_pool::MAX_IDLE_WORKERS, std::max(config.min_threads, 0));
+#if FUSE_USE_VERSION >= FUSE_MAKE_VERSION(3, 12)
+    // libfuse refuses a ceiling above this
+    const unsigned int                NO_MAX_THREADS = 100000;
+    struct fuse_loop_config*        loop_config = fuse_loop_cfg_create();
+    if (!loop_config) {
+        return -1;
+    }
+    fuse_loop_cfg_set_clone_fd(loop_config, 1);
+    fuse_loop_cfg_set_idle_threads(loop_config, max_idle);
+    fuse_loop_cfg_set_max_threads(loop_config, config.max_threads > 0 ? std::min<unsigned int>(config.max_threads, NO_MAX_THREADS) : NO_MAX_THREADS);
+    const int                        res = fuse_session_loop_mt(sessions.front().se, loop_config);
+    fuse_loop_cfg_destroy(loop_config);
+    return res < 0 ? -1 : 0;
+#else
+    if (config.max_threads > 0) {
+        return Worker_pool(sessions, config.min_threads, config.max_threads).run();
+    }
+    struct fuse_loop_config        loop_config;
+    std::memset(&loop_config, 0, sizeof(loop_config));
+    loop_config.clone_fd = 1;
+    loop_config.max_idle_threads = max_idle;
+    return fuse_session_loop_mt(sessions.front().se, &loop_config) < 0 ? -1 : 0;
+#endif
+}
+#endif
+
+std::vector<struct fuse_session*>        exit_sessions;
+
+void exit_handler (int)
+{
+    for (struct fuse_session* se : exit_sessions) {
+        fuse_session_exit(se);
+    }
+}
+
+int set_exit_handlers (void (*handler)(int))
+{
+    struct sigaction        sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigemptyset(&sa.sa_mask);
+    for (int sig : {SIGHUP, SIGINT, SIGTERM}) {
+        if (sigaction(sig, &sa, nullptr) == -1) {
+            std::perror("disorderfs: cannot set signal handler");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Tells whoever started us that every mount is up: through --ready-fd, and
+// to a service manager through $NOTIFY_SOCKET, as sd_notify(3) would.
+// Requests that arrive before the loop starts just wait in the kernel.
+void notify_ready ()
+{
+    if (config.ready_fd >= 0) {
+        if (write(config.ready_fd, "\n", 1) == -1) {
+            std::perror("disorderfs: --ready-fd");
+        }
+        close(config.ready_fd);
+    }
+
+    const char*                socket_path = std::getenv("NOTIFY_SOCKET");
+    struct sockaddr_un        addr;
+    std::memset(&addr, 0, sizeof(addr));
+    if (!socket_path || (socket_path[0] != '/' && socket_path[0] != '@') || std::strlen(socket_path) >= sizeof(addr.sun_path)) {
+        return;
+    }
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, socket_path);
+    if (addr.sun_path[0] == '@') {
+        addr.sun_path[0] = '\0';        // abstract namespace
+    }
+    // fuse_daemonize has forked by now, so we're no longer the pid that was started
+    const std::string        message = "READY=1\nMAINPID=" + std::to_string(getpid());
+    const int                fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd != -1) {
+        sendto(fd, message.data(), message.size(), MSG_NOSIGNAL, reinterpret_cast<struct sockaddr*>(&addr),
+               offsetof(struct sockaddr_un, sun_path) + std::strlen(socket_path));
+        close(fd);
+    }
+}
+
+// What fuse_main does, but with the request loop in our own hands, and for
+// every mount at once
+int serve (struct fuse_args* args, const Fuse_operations* operations)
 {
-    if (key == FUSE_OPT_KEY_NONOPT) {
-        bare_arguments.emplace_back(arg);
-        return 0;
-    } else if (key == KEY_HELP) {
-        std::clog << "Usage: disorderfs [OPTIONS] ROOTDIR MOUNTPOINT" << std::endl;
-        std::clog << "General options:" << std::endl;
-        std::clog << "    -o opt,[opt...]        mount options (see below)" << std::endl;
-        std::clog << "    -h, --help             display help" << std::endl;
-        std::clog << "    -V, --version          display version info" << std::endl;
-        std::clog << "    -q, --quiet            don't output any status messages" << std::endl;
-        std::clog << std::endl;
-        std::clog << "disorderfs options:" << std::endl;
-        std::clog << "    --multi-user=yes|no    allow multiple users to access overlay (requires root; default: no)" << std::endl;
-        std::clog << "    --shuffle-dirents=yes|no  randomly shuffle directory entries? (default: no)" << std::endl;
-        std::clog << "    --reverse-dirents=yes|no  reverse dirent order? (default: yes)" << std::endl;
-        std::clog << "    --sort-dirents=yes|no  sort directory entries instead (default: no)" << std::endl;
-        std::clog << "    --sort-by-ctime=yes|no  sort directory entries by ctime as returned by lstat syscall instead of alphabetically (default: no). No effect if --sort-dirents=no (default). Will show the youngest file first if --reverse-dirents=yes." << std::endl;
-        std::clog << "    --pad-blocks=N         add N to st_blocks (default: 1)" << std::endl;
-        std::clog << "    --share-locks=yes|no   share locks with underlying filesystem (BUGGY; default: no)" << std::endl;
-        std::clog << std::endl;
-        fuse_opt_add_arg(outargs, "-ho");
-        fuse_main(outargs->argc, outargs->argv, &disorderfs_fuse_operations, nullptr);
-        std::exit(0);
-    } else if (key == KEY_VERSION) {
-        std::cout << "disorderfs version: " DISORDERFS_VERSION << std::endl;
-        fuse_opt_add_arg(outargs, "--version");
-        fuse_main(outargs->argc, outargs->argv, &disorderfs_fuse_operations, nullptr);
-        std::exit(0);
-    } else if (key == KEY_QUIET) {
-        config.quiet = true;
-        return 0;
+    int                        multithreaded;
+    int                        foreground;
+#if FUSE_USE_VERSION >= 30
+    struct fuse_cmdline_opts        opts;
+    if (fuse_parse_cmdline(args, &opts) == -1) {
+        return 1;
     }
-    return 1;
+    std::free(opts.mountpoint);        // we have our own
+    multithreaded = !opts.singlethread;
+    foreground = opts.foreground;
+#else
+    if (fuse_parse_cmdline(args, nullptr, &multithreaded, &foreground) == -1) {
+        return 1;
+    }
+#endif
+    std::vector<Worker_pool::Session>        sessions;
+    for (Mount& mount : mounts) {
+        struct fuse_args        margs = FUSE_ARGS_INIT(0, nullptr);
+        for (int i = 0; i < args->argc; ++i) {
+            fuse_opt_add_arg(&margs, args->argv[i]);
+        }
+        add_mount_options(&margs, mount.config);
+        for (const std::string& option : mount.fuse_options) {
+            fuse_opt_add_arg(&margs, option.c_str());
+        }
+#if FUSE_USE_VERSION >= 30
+        if (fuse_opt_parse(&margs, &mount.timeouts, timeout_opts, nullptr) != -1 &&
+                (mount.se = fuse_session_new(&margs, operations, sizeof(*operations), &mount))) {
+            if (fuse_session_mount(mount.se, mount.mountpoint.c_str()) == -1) {
+                fuse_session_destroy(mount.se);
+                mount.se = nullptr;
+            }
+        }
+        fuse_opt_free_args(&margs);
+        if (!mount.se) {
+            break;
+        }
+        sessions.push_back({mount.se});
+#else
+        if ((mount.ch = fuse_mount(mount.mountpoint.c_str(), &margs))) {
+            mount.fuse = fuse_new(mount.ch, &margs, operations, sizeof(*operations), &mount);
+            if (!mount.fuse) {
+                fuse_unmount(mount.mountpoint.c_str(), mount.ch);
+            }
+        }
+        fuse_opt_free_args(&margs);
+        if (!mount.fuse) {
+            break;
+        }
+        sessions.push_back({fuse_get_session(mount.fuse), mount.ch});
+#endif
+    }
+    int                        res = -1;
+#if FUSE_USE_VERSION >= 30
+    std::list<Change_watcher>        watchers;
+#endif
+    if (sessions.size() == mounts.size() && fuse_daemonize(foreground) != -1) {
+        for (const Worker_pool::Session& session : sessions) {
+            exit_sessions.push_back(session.se);
+        }
+        if (set_exit_handlers(exit_handler) != -1) {
+            if (metrics_enabled() || trace_ring.enabled()) {
+                std::thread(signal_thread).detach();
+            }
+#if FUSE_USE_VERSION >= 30
+            for (Mount& mount : mounts) {
+                if (Change_watcher::wanted(mount)) {
+                    watchers.emplace_back(mount);
+                }
+            }
+#endif
+            notify_ready();
+            if (multithreaded) {
+#if FUSE_USE_VERSION >= 30
+                if (sessions.size() == 1) {
+                    res = session_loop_mt(sessions);
+                } else
+#endif
+                res = Worker_pool(sessions, config.min_threads, config.max_threads).run();
+            } else if (sessions.size() > 1) {
+                res = Worker_pool(sessions, 1, 1).run();
+            } else {
+#if FUSE_USE_VERSION >= 30
+                res = fuse_session_loop(mounts.front().se) < 0 ? -1 : 0;
+#else
+                res = fuse_loop(mounts.front().fuse);
+#endif
+            }
+        }
+        set_exit_handlers(SIG_DFL);
+    }
+#if FUSE_USE_VERSION >= 30
+    watchers.clear();
+#endif
+    for (Mount& mount : mounts) {
+#if FUSE_USE_VERSION >= 30
+        if (mount.se) {
+            fuse_session_unmount(mount.se);
+            fuse_session_destroy(mount.se);
+        }
+#else
+        if (mount.fuse) {
+            fuse_unmount(mount.mountpoint.c_str(), mount.ch);
+            fuse_destroy(mount.fuse);
+        }
+#endif
+    }
+    return res == -1 ? 1 : 0;
 }
 }
 
@@ -323,31 +4228,91 @@ int        main (int argc, char** argv)
     struct fuse_args        fargs = FUSE_ARGS_INIT(argc, argv);
     fuse_opt_parse(&fargs, &config, disorderfs_fuse_opts, fuse_opt_proc);
 
-    if (bare_arguments.size() != 2) {
+    if (mounts_file.empty() ? bare_arguments.size() != 2 : !bare_arguments.empty()) {
         std::clog << "disorderfs: error: wrong number of arguments" << std::endl;
         std::clog << "Usage: disorderfs [OPTIONS] ROOTDIR MOUNTPOINT" << std::endl;
+        std::clog << "       disorderfs [OPTIONS] --mounts=FILE" << std::endl;
         return 2;
     }
 
-    if (char* resolved_path = realpath(bare_arguments[0].c_str(), nullptr)) {
-        root = resolved_path;
-        std::free(resolved_path);
+    if (mounts_file.empty()) {
+        mounts.emplace_back();
+        mounts.back().root = bare_arguments[0];
+        mounts.back().mountpoint = bare_arguments[1];
+        mounts.back().config = config;
     } else {
-        std::perror(bare_arguments[0].c_str());
-        return 1;
+        const std::string error = load_mounts(mounts_file);
+        if (!error.empty()) {
+            std::clog << "disorderfs: error: " << mounts_file << ": " << error << std::endl;
+            return 1;
+        }
+    }
+    for (Mount& mount : mounts) {
+#if FUSE_USE_VERSION < 30
+        if (mount.config.io == IO_WRITEBACK || mount.config.io == IO_PASSTHROUGH) {
+            std::clog << "disorderfs: error: --io=writeback and --io=passthrough need the FUSE 3 backend (build with ENABLE_FUSE3=yes)" << std::endl;
+            return 1;
+        }
+#elif !defined(FUSE_CAP_PASSTHROUGH)
+        if (mount.config.io == IO_PASSTHROUGH) {
+            std::clog << "disorderfs: error: --io=passthrough needs libfuse 3.17 or later" << std::endl;
+            return 1;
+        }
+#endif
+        if (!open_root(mount)) {
+            return 1;
+        }
     }
 
-    // Add some of our own hard-coded FUSE options:
-    fuse_opt_add_arg(&fargs, "-o");
-    fuse_opt_add_arg(&fargs, "atomic_o_trunc,default_permissions,use_ino"); // XXX: other mount options?
-    if (config.multi_user) {
-        fuse_opt_add_arg(&fargs, "-o");
-        fuse_opt_add_arg(&fargs, "allow_other");
+    if (config.listing_cache > 0) {
+        listing_cache.set_capacity(static_cast<size_t>(config.listing_cache) << 20);
+    }
+    if (!policy_file.empty()) {
+        const std::string error = policy.load(policy_file);
+        if (!error.empty()) {
+            std::clog << "disorderfs: error: " << policy_file << ": " << error << std::endl;
+            return 1;
+        }
+    }
+    if (config.listing_memory > 0) {
+        listing_budget.set_capacity(static_cast<size_t>(config.listing_memory) << 20);
+    }
+    if (!trace_file.empty() && config.trace_buffer > 0) {
+        trace_ring.set_capacity(config.trace_buffer);
+    }
+#if FUSE_USE_VERSION >= 30
+    // disorderfs-replay works from paths, which the low-level API doesn't have
+    if (!record_file.empty()) {
+        std::clog << "disorderfs: error: --record needs the libfuse 2 backend (build without ENABLE_FUSE3)" << std::endl;
+        return 1;
+    }
+    // Nor does anything here resolve paths from the root, for --dirfd-cache
+    // to save walking down
+    for (const Mount& mount : mounts) {
+        if (mount.config.dirfd_cache > 0) {
+            std::clog << "disorderfs: error: --dirfd-cache needs the libfuse 2 backend (build without ENABLE_FUSE3)" << std::endl;
+            return 1;
+        }
+    }
+    // Every inode the kernel knows holds an fd
+    struct rlimit                rlim;
+    if (getrlimit(RLIMIT_NOFILE, &rlim) == 0 && rlim.rlim_cur < rlim.rlim_max) {
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rlim);
+    }
+#endif
+    // Before fuse_daemonize changes directory, so that FILE may be relative
+    if (!record_file.empty() && !recorder.open(record_file)) {
+        std::perror(record_file.c_str());
+        return 1;
     }
-    fuse_opt_add_arg(&fargs, bare_arguments[1].c_str());
 
-    if (!config.quiet) {
-        if (config.shuffle_dirents) {
+    if (!config.quiet && !mounts_file.empty()) {
+        std::cout << "disorderfs: serving " << mounts.size() << " mounts from " << mounts_file << std::endl;
+    } else if (!config.quiet) {
+        if (config.shuffle_dirents && config.shuffle_seeded) {
+            std::cout << "disorderfs: shuffling directory entries with seed " << config.shuffle_seed << std::endl;
+        } else if (config.shuffle_dirents) {
             std::cout << "disorderfs: shuffling directory entries" << std::endl;
         }
         if (config.sort_dirents) {
@@ -357,10 +4322,507 @@ int        main (int argc, char** argv)
         if (config.reverse_dirents) {
             std::cout << "disorderfs: reversing directory entries" << std::endl;
         }
+        if (!policy.empty()) {
+            std::cout << "disorderfs: ordering some directories as " << policy_file << " says" << std::endl;
+        }
     }
     /*
      * Initialize disorderfs_fuse_operations
      */
+#if FUSE_USE_VERSION >= 30
+    /*
+     * The low-level API names files by the inode numbers our lookups hand
+     * out (see Inode_table), and operations reply through Request instead
+     * of returning their result.
+     */
+    disorderfs_fuse_operations.init = [] (void* userdata, struct fuse_conn_info* conn) {
+        const Mount& mount = *static_cast<const Mount*>(userdata);
+        // What -o atomic_o_trunc asks for with libfuse 2: open is given
+        // O_TRUNC, instead of being followed by a truncate
+        conn->want |= conn->capable & FUSE_CAP_ATOMIC_O_TRUNC;
+        if (mount.config.io == IO_DEFAULT) {
+            return;
+        }
+        // Requests of up to 1 MiB, the most libfuse will take (the kernel
+        // raises max_pages to match), spliced between the kernel and the
+        // underlying files
+        conn->max_write = 1 << 20;
+        conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ | FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+        if (mount.config.io == IO_WRITEBACK) {
+            // The kernel gathers small writes in the page cache, and sends
+            // them on in large batches; see open_flags
+            conn->want |= conn->capable & FUSE_CAP_WRITEBACK_CACHE;
+        }
+#ifdef FUSE_CAP_PASSTHROUGH
+        if (mount.config.io == IO_PASSTHROUGH) {
+            // Reads and writes of regular files skip us; see open_file
+            conn->want |= conn->capable & FUSE_CAP_PASSTHROUGH;
+        }
+#endif
+    };
+    disorderfs_fuse_operations.lookup = [] (fuse_req_t req, fuse_ino_t parent, const char* name) {
+        Request r(req, OP_lookup, name);
+        Mount& mount = this_mount();
+        Guard g;
+        struct fuse_entry_param e;
+        const int res = lookup_entry(mount, mount.inodes.get(parent), name, e);
+        if (res == -ENOENT && mount.timeouts.negative > 0) {
+            // A negative entry, which the kernel remembers for us
+            std::memset(&e, 0, sizeof(e));
+            e.entry_timeout = mount.timeouts.negative;
+            return r.reply_entry(e);
+        }
+        if (res != 0) {
+            return r.reply_err(res);
+        }
+        r.reply_entry(e);
+    };
+    disorderfs_fuse_operations.forget = [] (fuse_req_t req, fuse_ino_t ino, uint64_t nlookup) {
+        Request r(req, OP_forget);
+        this_mount().inodes.forget(ino, nlookup);
+        r.reply_none();
+    };
+    disorderfs_fuse_operations.forget_multi = [] (fuse_req_t req, size_t count, struct fuse_forget_data* forgets) {
+        Request r(req, OP_forget_multi);
+        Mount& mount = this_mount();
+        for (size_t i = 0; i < count; ++i) {
+            mount.inodes.forget(forgets[i].ino, forgets[i].nlookup);
+        }
+        r.reply_none();
+    };
+    disorderfs_fuse_operations.getattr = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+        Request r(req, OP_getattr);
+        As_root root;
+        Mount& mount = this_mount();
+        struct stat st;
+        const int res = fi ? fstat(fi->fh, &st) : fstatat(mount.inodes.get(ino).fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW);
+        if (res == -1) {
+            return r.reply_err(-errno);
+        }
+        st.st_blocks += mount.config.pad_blocks;
+        r.reply_attr(st, mount.timeouts.attr);
+    };
+    disorderfs_fuse_operations.setattr = [] (fuse_req_t req, fuse_ino_t ino, struct stat* attr, int to_set, struct fuse_file_info* fi) {
+        Request r(req, OP_setattr);
+        Mount& mount = this_mount();
+        Inode& inode = mount.inodes.get(ino);
+        Guard g;
+        const Fd_path path(inode.fd, "");
+        int res = 0;
+        if (to_set & FUSE_SET_ATTR_MODE) {
+            // The POSIX ACL, if any, changes along with the mode
+            res = wrap(fi ? fchmod(fi->fh, attr->st_mode) : chmod(path.c_str(), attr->st_mode));
+            mount.xattr_cache.invalidate(inode.dev, inode.ino);
+        }
+        if (res == 0 && (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))) {
+            const uid_t uid = to_set & FUSE_SET_ATTR_UID ? attr->st_uid : static_cast<uid_t>(-1);
+            const gid_t gid = to_set & FUSE_SET_ATTR_GID ? attr->st_gid : static_cast<gid_t>(-1);
+            // Changing owner clears security.capability
+            res = wrap(fchownat(inode.fd, "", uid, gid, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW));
+            mount.xattr_cache.invalidate(inode.dev, inode.ino);
+        }
+        if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE)) {
+            res = wrap(fi ? ftruncate(fi->fh, attr->st_size) : truncate(path.c_str(), attr->st_size));
+        }
+        if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME))) {
+            struct timespec tv[2] = {attr->st_atim, attr->st_mtim};
+            if (!(to_set & FUSE_SET_ATTR_ATIME)) {
+                tv[0].tv_nsec = UTIME_OMIT;
+            } else if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+                tv[0].tv_nsec = UTIME_NOW;
+            }
+            if (!(to_set & FUSE_SET_ATTR_MTIME)) {
+                tv[1].tv_nsec = UTIME_OMIT;
+            } else if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+                tv[1].tv_nsec = UTIME_NOW;
+            }
+            if (fi) {
+                res = wrap(futimens(fi->fh, tv));
+            } else if (S_ISLNK(inode.type)) {
+                // The /proc link can't be trusted to stop at the symlink
+                // itself, so this needs a utimensat that takes AT_EMPTY_PATH
+                res = wrap(utimensat(inode.fd, "", tv, AT_EMPTY_PATH));
+                if (res == -EINVAL) {
+                    res = -EPERM;
+                }
+            } else {
+                res = wrap(utimensat(AT_FDCWD, path.c_str(), tv, 0));
+            }
+        }
+        struct stat st;
+        if (res == 0 && fstatat(inode.fd, "", &st, AT_EMPTY_PATH | AT_SYMLINK_NOFOLLOW) == -1) {
+            res = -errno;
+        }
+        if (res != 0) {
+            return r.reply_err(res);
+        }
+        st.st_blocks += mount.config.pad_blocks;
+        r.reply_attr(st, mount.timeouts.attr);
+    };
+    disorderfs_fuse_operations.readlink = [] (fuse_req_t req, fuse_ino_t ino) {
+        Request r(req, OP_readlink);
+        Guard g;
+        char buf[PATH_MAX + 1];
+        const ssize_t len{readlinkat(this_mount().inodes.get(ino).fd, "", buf, sizeof(buf) - 1)};
+        if (len == -1) {
+            return r.reply_err(-errno);
+        }
+        buf[len] = '\0';
+        r.reply_readlink(buf);
+    };
+    disorderfs_fuse_operations.mknod = [] (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, dev_t dev) {
+        Request r(req, OP_mknod, name);
+        Mount& mount = this_mount();
+        const Inode& dir = mount.inodes.get(parent);
+        Guard g;
+        reply_made(r, mount, dir, name, wrap(mknodat(dir.fd, name, mode, dev)));
+    };
+    disorderfs_fuse_operations.mkdir = [] (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode) {
+        Request r(req, OP_mkdir, name);
+        Mount& mount = this_mount();
+        const Inode& dir = mount.inodes.get(parent);
+        Guard g;
+        reply_made(r, mount, dir, name, wrap(mkdirat(dir.fd, name, mode)));
+    };
+    disorderfs_fuse_operations.unlink = [] (fuse_req_t req, fuse_ino_t parent, const char* name) {
+        Request r(req, OP_unlink, name);
+        Guard g;
+        r.reply_err(wrap(unlinkat(this_mount().inodes.get(parent).fd, name, 0)));
+    };
+    disorderfs_fuse_operations.rmdir = [] (fuse_req_t req, fuse_ino_t parent, const char* name) {
+        Request r(req, OP_rmdir, name);
+        Guard g;
+        r.reply_err(wrap(unlinkat(this_mount().inodes.get(parent).fd, name, AT_REMOVEDIR)));
+    };
+    disorderfs_fuse_operations.symlink = [] (fuse_req_t req, const char* target, fuse_ino_t parent, const char* name) {
+        Request r(req, OP_symlink, name);
+        Mount& mount = this_mount();
+        const Inode& dir = mount.inodes.get(parent);
+        Guard g;
+        reply_made(r, mount, dir, name, wrap(symlinkat(target, dir.fd, name)));
+    };
+    disorderfs_fuse_operations.rename = [] (fuse_req_t req, fuse_ino_t parent, const char* name, fuse_ino_t newparent, const char* newname, unsigned int flags) {
+        Request r(req, OP_rename, name);
+        Mount& mount = this_mount();
+        const int dirfd = mount.inodes.get(parent).fd;
+        const int newdirfd = mount.inodes.get(newparent).fd;
+        Guard g;
+        // RENAME_NOREPLACE and RENAME_EXCHANGE need renameat2
+        r.reply_err(wrap(flags ? syscall(SYS_renameat2, dirfd, name, newdirfd, newname, flags) : renameat(dirfd, name, newdirfd, newname)));
+    };
+    disorderfs_fuse_operations.link = [] (fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char* newname) {
+        Request r(req, OP_link, newname);
+        Mount& mount = this_mount();
+        const Inode& inode = mount.inodes.get(ino);
+        const Inode& dir = mount.inodes.get(newparent);
+        Guard g;
+        // linkat's AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH, so link through
+        // the /proc link to the file instead
+        reply_made(r, mount, dir, newname, wrap(linkat(AT_FDCWD, Fd_path(inode.fd, "").c_str(), dir.fd, newname, AT_SYMLINK_FOLLOW)));
+    };
+    disorderfs_fuse_operations.open = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+        Request r(req, OP_open);
+        Mount& mount = this_mount();
+        Inode& inode = mount.inodes.get(ino);
+        Guard g;
+        // Reopen the file itself through /proc; O_NOFOLLOW would refuse the
+        // /proc link, and the kernel has resolved any symlink already
+        const int fd{open(Fd_path(inode.fd, "").c_str(), open_flags(mount, fi->flags) & ~O_NOFOLLOW)};
+        if (fd == -1) {
+            return r.reply_err(-errno);
+        }
+        open_file(req, mount, inode, fd, fi);
+        r.reply_open(fi);
+    };
+    /*
+     * read, write_buf, fsync and fallocate block the worker thread for as
+     * long as the underlying syscall takes, as in the high-level backend.
+     * There is no io_uring engine here either.  The low-level API would let
+     * them reply later, from a completion, and so free the worker; but that
+     * is not implemented, as it would take liburing, which the build doesn't
+     * use, a thread reaping completions, submissions made with the caller's
+     * credentials under --multi-user=yes (a ring has its creator's), and
+     * giving up read's splice from the file, which io_uring can't reply with.
+     */
+    disorderfs_fuse_operations.read = [] (fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info* fi) {
+        Request r(req, OP_read);
+        As_root root;
+        struct fuse_bufvec src = fd_bufvec(fi->fh, size, off);
+        r.reply_data(src, FUSE_BUF_SPLICE_MOVE);
+    };
+    disorderfs_fuse_operations.write_buf = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec* buf, off_t off, struct fuse_file_info* fi) {
+        Request r(req, OP_write_buf);
+        As_root root;
+        struct fuse_bufvec dst = fd_bufvec(fi->fh, fuse_buf_size(buf), off);
+        const ssize_t res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+        if (res < 0) {
+            return r.reply_err(res);
+        }
+        r.reply_write(res);
+    };
+    disorderfs_fuse_operations.statfs = [] (fuse_req_t req, fuse_ino_t ino) {
+        Request r(req, OP_statfs);
+        Guard g;
+        struct statvfs f;
+        if (fstatvfs(this_mount().inodes.get(ino).fd, &f) == -1) {
+            return r.reply_err(-errno);
+        }
+        r.reply_statfs(f);
+    };
+    disorderfs_fuse_operations.flush = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+        Request r(req, OP_flush);
+        As_root root;
+        if (config.share_locks) {
+            // libfuse 2 sends this unlock itself; see Lock_fds
+            struct flock lock;
+            std::memset(&lock, 0, sizeof(lock));
+            lock.l_type = F_UNLCK;
+            lock.l_whence = SEEK_SET;
+            lock_fds.lock(fi->fh, fi->lock_owner, F_SETLK, &lock);
+        }
+        r.reply_err(wrap(close(dup(fi->fh))));
+    };
+    disorderfs_fuse_operations.release = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+        Request r(req, OP_release);
+        As_root root;
+        close(fi->fh);
+        release_file(req, this_mount().inodes.get(ino));
+        r.reply_err(0);
+    };
+    disorderfs_fuse_operations.fsync = [] (fuse_req_t req, fuse_ino_t ino, int is_datasync, struct fuse_file_info* fi) {
+        Request r(req, OP_fsync);
+        As_root root;
+        r.reply_err(wrap(is_datasync ? fdatasync(fi->fh) : fsync(fi->fh)));
+    };
+    disorderfs_fuse_operations.setxattr = [] (fuse_req_t req, fuse_ino_t ino, const char* name, const char* value, size_t size, int flags) {
+        Request r(req, OP_setxattr);
+        Mount& mount = this_mount();
+        Inode& inode = mount.inodes.get(ino);
+        Guard g;
+        const Xattr_path path(inode);
+        if (path.error) {
+            return r.reply_err(path.error);
+        }
+        const int res = wrap(path.follow ? setxattr(path.c_str(), name, value, size, flags) : lsetxattr(path.c_str(), name, value, size, flags));
+        mount.xattr_cache.invalidate(inode.dev, inode.ino);
+        r.reply_err(res);
+    };
+    disorderfs_fuse_operations.getxattr = [] (fuse_req_t req, fuse_ino_t ino, const char* name, size_t size) {
+        Request r(req, OP_getxattr);
+        Mount& mount = this_mount();
+        Inode& inode = mount.inodes.get(ino);
+        if (!mount.config.security_xattrs && std::strncmp(name, "security.", 9) == 0) {
+            return r.reply_err(-ENODATA);
+        }
+        static thread_local std::vector<char> value;
+        value.resize(size);
+        Xattr_cache::Reader reader;
+        if (mount.xattr_cache.enabled() && xattr_requester(reader)) {
+            std::string        data;
+            int                error;
+            if (mount.xattr_cache.find(inode.dev, inode.ino, name, reader, data, error)) {
+                return r.reply_xattr(error ? -error : xattr_reply(data, value.data(), size), value.data(), size);
+            }
+        }
+        Guard g;
+        const Xattr_path path(inode);
+        if (path.error) {
+            return r.reply_err(path.error);
+        }
+        if (mount.xattr_cache.enabled()) {
+            const char*        data;
+            const ssize_t        res = read_xattr(path.c_str(), name, data, path.follow);
+            if (res >= 0 || res == -ENODATA || res == -ENOTSUP) {
+                mount.xattr_cache.insert(inode.dev, inode.ino, name, xattr_reader(), data, res >= 0 ? res : 0, res >= 0 ? 0 : -res);
+            }
+            return r.reply_xattr(res >= 0 ? xattr_reply(std::string(data, res), value.data(), size) : res, value.data(), size);
+        }
+        const ssize_t res = path.follow ? getxattr(path.c_str(), name, value.data(), size) : lgetxattr(path.c_str(), name, value.data(), size);
+        r.reply_xattr(res >= 0 ? res : -errno, value.data(), size);
+    };
+    disorderfs_fuse_operations.listxattr = [] (fuse_req_t req, fuse_ino_t ino, size_t size) {
+        Request r(req, OP_listxattr);
+        Mount& mount = this_mount();
+        Inode& inode = mount.inodes.get(ino);
+        static thread_local std::vector<char> list;
+        list.resize(size);
+        Xattr_cache::Reader reader;
+        if (mount.xattr_cache.enabled() && xattr_requester(reader)) {
+            std::string        data;
+            int                error;
+            if (mount.xattr_cache.find(inode.dev, inode.ino, nullptr, reader, data, error)) {
+                return r.reply_xattr(error ? -error : xattr_reply(data, list.data(), size), list.data(), size);
+            }
+        }
+        Guard g;
+        const Xattr_path path(inode);
+        if (path.error) {
+            return r.reply_err(path.error);
+        }
+        if (mount.xattr_cache.enabled()) {
+            const char*        data;
+            const ssize_t        res = read_xattr(path.c_str(), nullptr, data, path.follow);
+            if (res >= 0 || res == -ENOTSUP) {
+                mount.xattr_cache.insert(inode.dev, inode.ino, nullptr, xattr_reader(), data, res >= 0 ? res : 0, res >= 0 ? 0 : -res);
+            }
+            return r.reply_xattr(res >= 0 ? xattr_reply(std::string(data, res), list.data(), size) : res, list.data(), size);
+        }
+        const ssize_t res = path.follow ? listxattr(path.c_str(), list.data(), size) : llistxattr(path.c_str(), list.data(), size);
+        r.reply_xattr(res >= 0 ? res : -errno, list.data(), size);
+    };
+    disorderfs_fuse_operations.removexattr = [] (fuse_req_t req, fuse_ino_t ino, const char* name) {
+        Request r(req, OP_removexattr);
+        Mount& mount = this_mount();
+        Inode& inode = mount.inodes.get(ino);
+        Guard g;
+        const Xattr_path path(inode);
+        if (path.error) {
+            return r.reply_err(path.error);
+        }
+        const int res = wrap(path.follow ? removexattr(path.c_str(), name) : lremovexattr(path.c_str(), name));
+        mount.xattr_cache.invalidate(inode.dev, inode.ino);
+        r.reply_err(res);
+    };
+    disorderfs_fuse_operations.opendir = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+        Request r(req, OP_opendir);
+        Mount& mount = this_mount();
+        Inode& inode = mount.inodes.get(ino);
+        Guard g;
+        const Ordering* ordering = nullptr;
+        std::string path;
+        if (!policy.empty() && inode_path(mount, inode, path)) {
+            ordering = policy.find(path.c_str());
+        }
+        const int fd{openat(inode.fd, ".", O_RDONLY | O_DIRECTORY)};
+        if (fd == -1) {
+            return r.reply_err(-errno);
+        }
+        struct stat st;
+        const bool have_stat = fstat(fd, &st) == 0;
+        std::unique_ptr<Dir_handle> handle;
+        if (const int res = open_dir_handle(fd, ordering ? *ordering : default_ordering(mount.config), handle)) {
+            return r.reply_err(res);
+        }
+        // The kernel may keep a deterministic listing in its page cache,
+        // and drops it itself when the directory changes through the mount;
+        // cache_still_valid catches changes made behind our back.  Sorting
+        // by ctime depends on the entries' ctimes, which can change without
+        // the directory itself changing.
+        const Ordering& o = handle->ordering;
+        if (mount.config.cache != CACHE_STRICT && have_stat && !o.passthrough && !o.shuffle && !(o.sort && o.sort_by_ctime)) {
+            fi->cache_readdir = 1;
+            fi->keep_cache = cache_still_valid(inode, st, o.id());
+        }
+        set_fuse_data<Dir_handle*>(fi, handle.release());
+        r.reply_open(fi);
+    };
+    disorderfs_fuse_operations.readdir = [] (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+        Request r(req, OP_readdir);
+        Mount& mount = this_mount();
+        static thread_local std::vector<char> buf;
+        buf.resize(size);
+        const int res = fill_dir(req, mount, mount.inodes.get(ino), *get_fuse_data<Dir_handle*>(fi), offset, buf.data(), size, false);
+        if (res < 0) {
+            return r.reply_err(res);
+        }
+        r.reply_buf(buf.data(), res);
+    };
+    disorderfs_fuse_operations.readdirplus = [] (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info* fi) {
+        Request r(req, OP_readdirplus);
+        Mount& mount = this_mount();
+        static thread_local std::vector<char> buf;
+        buf.resize(size);
+        // Each entry is looked up, sparing the kernel a lookup per entry
+        Guard g;
+        const int res = fill_dir(req, mount, mount.inodes.get(ino), *get_fuse_data<Dir_handle*>(fi), offset, buf.data(), size, true);
+        if (res < 0) {
+            return r.reply_err(res);
+        }
+        r.reply_buf(buf.data(), res);
+    };
+    disorderfs_fuse_operations.releasedir = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+        Request r(req, OP_releasedir);
+        Dir_handle* handle = get_fuse_data<Dir_handle*>(fi);
+        listing_budget.remove(*handle);
+        delete handle;
+        r.reply_err(0);
+    };
+    disorderfs_fuse_operations.fsyncdir = [] (fuse_req_t req, fuse_ino_t ino, int is_datasync, struct fuse_file_info* fi) {
+        Request r(req, OP_fsyncdir);
+        Guard g;
+        const int fd{openat(this_mount().inodes.get(ino).fd, ".", O_RDONLY | O_DIRECTORY)};
+        if (fd == -1) {
+            return r.reply_err(-errno);
+        }
+        const int res = wrap(is_datasync ? fdatasync(fd) : fsync(fd));
+        close(fd);
+        r.reply_err(res);
+    };
+    disorderfs_fuse_operations.create = [] (fuse_req_t req, fuse_ino_t parent, const char* name, mode_t mode, struct fuse_file_info* fi) {
+        Request r(req, OP_create, name);
+        Mount& mount = this_mount();
+        const Inode& dir = mount.inodes.get(parent);
+        Guard g;
+        const int fd{openat(dir.fd, name, open_flags(mount, fi->flags) | O_CREAT, mode)};
+        if (fd == -1) {
+            return r.reply_err(-errno);
+        }
+        struct fuse_entry_param e;
+        if (const int res = lookup_entry(mount, dir, name, e)) {
+            close(fd);
+            return r.reply_err(res);
+        }
+        open_file(req, mount, mount.inodes.get(e.ino), fd, fi);
+        r.reply_create(e, fi);
+    };
+    if (config.share_locks) {
+        disorderfs_fuse_operations.getlk = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi, struct flock* lock) {
+            Request r(req, OP_getlk);
+            Guard g;
+            if (const int res = lock_fds.lock(fi->fh, fi->lock_owner, F_GETLK, lock)) {
+                return r.reply_err(res);
+            }
+            r.reply_lock(*lock);
+        };
+        disorderfs_fuse_operations.setlk = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi, struct flock* lock, int sleep) {
+            Request r(req, OP_setlk);
+            // Reopening the file checks the requester's permissions
+            Guard g;
+            r.reply_err(lock_fds.lock(fi->fh, fi->lock_owner, sleep ? F_SETLKW : F_SETLK, lock));
+        };
+        disorderfs_fuse_operations.flock = [] (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi, int op) {
+            Request r(req, OP_flock);
+            As_root root;
+            r.reply_err(wrap(flock(fi->fh, op)));
+        };
+    }
+    disorderfs_fuse_operations.fallocate = [] (fuse_req_t req, fuse_ino_t ino, int mode, off_t off, off_t len, struct fuse_file_info* fi) {
+        Request r(req, OP_fallocate);
+        As_root root;
+        r.reply_err(wrap(fallocate(fi->fh, mode, off, len)));
+    };
+    // So that copies can reflink on the underlying filesystem
+    disorderfs_fuse_operations.copy_file_range = [] (fuse_req_t req, fuse_ino_t ino_in, off_t off_in, struct fuse_file_info* fi_in,
+                                                     fuse_ino_t ino_out, off_t off_out, struct fuse_file_info* fi_out, size_t len, int flags) {
+        Request r(req, OP_copy_file_range);
+        As_root root;
+        const ssize_t res = copy_file_range(fi_in->fh, &off_in, fi_out->fh, &off_out, len, flags);
+        if (res == -1) {
+            return r.reply_err(-errno);
+        }
+        r.reply_write(res);
+    };
+    // So that SEEK_DATA and SEEK_HOLE find the underlying file's holes
+    disorderfs_fuse_operations.lseek = [] (fuse_req_t req, fuse_ino_t ino, off_t off, int whence, struct fuse_file_info* fi) {
+        Request r(req, OP_lseek);
+        As_root root;
+        const off_t res = lseek(fi->fh, off, whence);
+        if (res == -1) {
+            return r.reply_err(-errno);
+        }
+        r.reply_lseek(res);
+    };
+#else
 
     /*
      * Indicate that we should accept UTIME_OMIT (and UTIME_NOW) in the
@@ -368,17 +4830,40 @@ int        main (int argc, char** argv)
      */
     disorderfs_fuse_operations.flag_utime_omit_ok = 1;
 
+    /*
+     * Operations on an open file or directory never look at their path, so
+     * tell FUSE not to bother building one for them.
+     */
+    disorderfs_fuse_operations.flag_nullpath_ok = 1;
+    disorderfs_fuse_operations.flag_nopath = 1;
+
     disorderfs_fuse_operations.getattr = [] (const char* path, struct stat* st) -> int {
+        Mount& mount = this_mount();
+        // Before the Guard on purpose, so that a hit doesn't pay for looking
+        // up the caller's groups: a missing name is missing for every
+        // caller, and with default_permissions the kernel has already
+        // checked that this one may search the directories on the way
+        if (mount.negative_cache.enabled() && mount.negative_cache.contains(path)) {
+            return -ENOENT;
+        }
         Guard g;
-        if (lstat((root + path).c_str(), st) == -1) {
+        const At_path p(path);
+        if (fstatat(p.fd, p.name, st, AT_SYMLINK_NOFOLLOW) == -1) {
+            if (errno == ENOENT && mount.negative_cache.enabled()) {
+                mount.negative_cache.insert(path);
+            }
             return -errno;
         }
-        st->st_blocks += config.pad_blocks;
+        if (mount.xattr_cache.enabled()) {
+            mount.xattr_cache.set_inode(path, *st);
+        }
+        st->st_blocks += mount.config.pad_blocks;
         return 0;
     };
     disorderfs_fuse_operations.readlink = [] (const char* path, char* buf, size_t sz) -> int {
         Guard g;
-        const ssize_t len{readlink((root + path).c_str(), buf, sz - 1)}; // sz > 0, since it includes space for null terminator
+        const At_path p(path);
+        const ssize_t len{readlinkat(p.fd, p.name, buf, sz - 1)}; // sz > 0, since it includes space for null terminator
         if (len == -1) {
             return -errno;
         }
@@ -387,54 +4872,108 @@ int        main (int argc, char** argv)
     };
     disorderfs_fuse_operations.mknod = [] (const char* path, mode_t mode, dev_t dev) -> int {
         Guard g;
-        return wrap(mknod((root + path).c_str(), mode, dev));
+        const At_path p(path);
+        const int res = wrap(mknodat(p.fd, p.name, mode, dev));
+        this_mount().negative_cache.invalidate(path);
+        return res;
     };
     disorderfs_fuse_operations.mkdir = [] (const char* path, mode_t mode) -> int {
         Guard g;
-        return wrap(mkdir((root + path).c_str(), mode));
+        const At_path p(path);
+        const int res = wrap(mkdirat(p.fd, p.name, mode));
+        this_mount().negative_cache.invalidate(path);
+        return res;
     };
     disorderfs_fuse_operations.unlink = [] (const char* path) -> int {
         Guard g;
-        return wrap(unlink((root + path).c_str()));
+        const At_path p(path);
+        const int res = wrap(unlinkat(p.fd, p.name, 0));
+        this_mount().xattr_cache.forget_path(path);
+        return res;
     };
     disorderfs_fuse_operations.rmdir = [] (const char* path) -> int {
         Guard g;
-        return wrap(rmdir((root + path).c_str()));
+        const At_path p(path);
+        const int res = wrap(unlinkat(p.fd, p.name, AT_REMOVEDIR));
+        this_mount().dirfd_cache.invalidate(relative(path));
+        this_mount().xattr_cache.forget_path(path);
+        return res;
     };
     disorderfs_fuse_operations.symlink = [] (const char* target, const char* linkpath) -> int {
         Guard g;
-        return wrap(symlink(target, (root + linkpath).c_str()));
+        const At_path p(linkpath);
+        const int res = wrap(symlinkat(target, p.fd, p.name));
+        this_mount().negative_cache.invalidate(linkpath);
+        return res;
     };
     disorderfs_fuse_operations.rename = [] (const char* oldpath, const char* newpath) -> int {
         Guard g;
-        return wrap(rename((root + oldpath).c_str(), (root + newpath).c_str()));
+        const At_path old_p(oldpath);
+        const At_path new_p(newpath);
+        Mount& mount = this_mount();
+        const int res = wrap(renameat(old_p.fd, old_p.name, new_p.fd, new_p.name));
+        mount.dirfd_cache.invalidate(relative(oldpath));
+        mount.dirfd_cache.invalidate(relative(newpath));
+        mount.xattr_cache.clear();
+        // A directory brings everything beneath it along to newpath
+        struct stat st;
+        if (res == 0 && mount.negative_cache.enabled() && fstatat(new_p.fd, new_p.name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode)) {
+            mount.negative_cache.clear();
+        } else {
+            mount.negative_cache.invalidate(newpath);
+        }
+        return res;
     };
     disorderfs_fuse_operations.link = [] (const char* oldpath, const char* newpath) -> int {
         Guard g;
-        return wrap(link((root + oldpath).c_str(), (root + newpath).c_str()));
+        const At_path old_p(oldpath);
+        const At_path new_p(newpath);
+        const int res = wrap(linkat(old_p.fd, old_p.name, new_p.fd, new_p.name, 0));
+        this_mount().negative_cache.invalidate(newpath);
+        return res;
     };
     disorderfs_fuse_operations.chmod = [] (const char* path, mode_t mode) -> int {
         Guard g;
-        return wrap(chmod((root + path).c_str(), mode));
+        const At_path p(path);
+        // The POSIX ACL, if any, changes along with the mode
+        const int res = wrap(fchmodat(p.fd, p.name, mode, 0));
+        forget_xattrs(this_mount(), path);
+        return res;
     };
     disorderfs_fuse_operations.chown = [] (const char* path, uid_t uid, gid_t gid) -> int {
         Guard g;
-        return wrap(lchown((root + path).c_str(), uid, gid));
+        const At_path p(path);
+        // Changing owner clears security.capability
+        const int res = wrap(fchownat(p.fd, p.name, uid, gid, AT_SYMLINK_NOFOLLOW));
+        forget_xattrs(this_mount(), path);
+        return res;
     };
     disorderfs_fuse_operations.truncate = [] (const char* path, off_t length) -> int {
         Guard g;
-        return wrap(truncate((root + path).c_str(), length));
+        const At_path p(path);
+        return wrap(truncate(Fd_path(p.fd, p.name).c_str(), length));
     };
     disorderfs_fuse_operations.open = [] (const char* path, struct fuse_file_info* info) -> int {
         Guard g;
-        const int fd{open((root + path).c_str(), info->flags)};
+        const At_path p(path);
+        const int fd{openat(p.fd, p.name, info->flags)};
         if (fd == -1) {
             return -errno;
         }
         info->fh = fd;
         return 0;
     };
+    /*
+     * read, write, fsync and fallocate block the worker thread for as long as
+     * the underlying syscall takes.  There is no io_uring engine, and none is
+     * planned for this API: the high-level API completes a request when its
+     * callback returns, so a callback that submitted to io_uring would only
+     * wait on the completion instead of on the syscall, holding the worker
+     * just as long.  See the FUSE 3 backend's read for what it would take
+     * there.
+     */
     disorderfs_fuse_operations.read = [] (const char* path, char* buf, size_t sz, off_t off, struct fuse_file_info* info) -> int {
+        As_root root;
         size_t bytes_read = 0;
         while (bytes_read < sz) {
             const ssize_t res = pread(info->fh, buf + bytes_read, sz - bytes_read, off + bytes_read);
@@ -449,6 +4988,7 @@ int        main (int argc, char** argv)
         return bytes_read;
     };
     disorderfs_fuse_operations.write = [] (const char* path, const char* buf, size_t sz, off_t off, struct fuse_file_info* info) -> int {
+        As_root root;
         size_t bytes_written = 0;
         while (bytes_written < sz) {
             const ssize_t res = pwrite(info->fh, buf + bytes_written, sz - bytes_written, off + bytes_written);
@@ -462,102 +5002,165 @@ int        main (int argc, char** argv)
     };
     disorderfs_fuse_operations.statfs = [] (const char* path, struct statvfs* f) -> int {
         Guard g;
-        return wrap(statvfs((root + path).c_str(), f));
+        const At_path p(path);
+        return wrap(statvfs(Fd_path(p.fd, p.name).c_str(), f));
     };
     disorderfs_fuse_operations.flush = [] (const char* path, struct fuse_file_info* info) -> int {
+        As_root root;
         return wrap(close(dup(info->fh)));
     };
     disorderfs_fuse_operations.release = [] (const char* path, struct fuse_file_info* info) -> int {
+        As_root root;
         close(info->fh);
         return 0; // return value is ignored
     };
     disorderfs_fuse_operations.fsync = [] (const char* path, int is_datasync, struct fuse_file_info* info) -> int {
+        As_root root;
         return wrap(is_datasync ? fdatasync(info->fh) : fsync(info->fh));
     };
     disorderfs_fuse_operations.setxattr = [] (const char* path, const char* name, const char* value, size_t size, int flags) -> int {
         Guard g;
-        return wrap(lsetxattr((root + path).c_str(), name, value, size, flags));
+        const At_path p(path);
+        const int res = wrap(lsetxattr(Fd_path(p.fd, p.name).c_str(), name, value, size, flags));
+        forget_xattrs(this_mount(), path);
+        return res;
     };
     disorderfs_fuse_operations.getxattr = [] (const char* path, const char* name, char* value, size_t size) -> int {
+        Mount& mount = this_mount();
+        if (!mount.config.security_xattrs && std::strncmp(name, "security.", 9) == 0) {
+            return -ENODATA;
+        }
+        dev_t dev;
+        ino_t ino;
+        Xattr_cache::Reader reader;
+        if (mount.xattr_cache.enabled() && mount.xattr_cache.find_inode(path, dev, ino) && xattr_requester(reader)) {
+            std::string        data;
+            int                error;
+            if (mount.xattr_cache.find(dev, ino, name, reader, data, error)) {
+                return error ? -error : xattr_reply(data, value, size);
+            }
+        }
         Guard g;
-        ssize_t res = lgetxattr((root + path).c_str(), name, value, size);
+        const At_path p(path);
+        if (mount.xattr_cache.enabled()) {
+            const char*        data;
+            const ssize_t        res = read_xattr(Fd_path(p.fd, p.name).c_str(), name, data);
+            if ((res >= 0 || res == -ENODATA || res == -ENOTSUP) && xattr_inode(mount, path, dev, ino)) {
+                mount.xattr_cache.insert(dev, ino, name, xattr_reader(), data, res >= 0 ? res : 0, res >= 0 ? 0 : -res);
+            }
+            return res >= 0 ? xattr_reply(std::string(data, res), value, size) : res;
+        }
+        ssize_t res = lgetxattr(Fd_path(p.fd, p.name).c_str(), name, value, size);
         return res >= 0 ? res : -errno;
     };
     disorderfs_fuse_operations.listxattr = [] (const char* path, char* list, size_t size) -> int {
+        Mount& mount = this_mount();
+        dev_t dev;
+        ino_t ino;
+        Xattr_cache::Reader reader;
+        if (mount.xattr_cache.enabled() && mount.xattr_cache.find_inode(path, dev, ino) && xattr_requester(reader)) {
+            std::string        data;
+            int                error;
+            if (mount.xattr_cache.find(dev, ino, nullptr, reader, data, error)) {
+                return error ? -error : xattr_reply(data, list, size);
+            }
+        }
         Guard g;
-        ssize_t res = llistxattr((root + path).c_str(), list, size);
+        const At_path p(path);
+        if (mount.xattr_cache.enabled()) {
+            const char*        data;
+            const ssize_t        res = read_xattr(Fd_path(p.fd, p.name).c_str(), nullptr, data);
+            if ((res >= 0 || res == -ENOTSUP) && xattr_inode(mount, path, dev, ino)) {
+                mount.xattr_cache.insert(dev, ino, nullptr, xattr_reader(), data, res >= 0 ? res : 0, res >= 0 ? 0 : -res);
+            }
+            return res >= 0 ? xattr_reply(std::string(data, res), list, size) : res;
+        }
+        ssize_t res = llistxattr(Fd_path(p.fd, p.name).c_str(), list, size);
         return res >= 0 ? res : -errno;
     };
     disorderfs_fuse_operations.removexattr = [] (const char* path, const char* name) -> int {
         Guard g;
-        return wrap(lremovexattr((root + path).c_str(), name));
+        const At_path p(path);
+        const int res = wrap(lremovexattr(Fd_path(p.fd, p.name).c_str(), name));
+        forget_xattrs(this_mount(), path);
+        return res;
     };
     disorderfs_fuse_operations.opendir = [] (const char* path, struct fuse_file_info* info) -> int {
         Guard g;
-        std::unique_ptr<Dirents> dirents{new Dirents};
-        DIR* d = opendir((root + path).c_str());
-        if (!d) {
-            return -errno;
-        }
-        struct dirent*        dirent_p;
-        errno = 0;
-        while ((dirent_p = readdir(d)) != NULL) {
-            dirents->emplace_back(std::make_pair(dirent_p->d_name, dirent_p->d_ino));
-        }
-        if (errno != 0) {
+        const At_path p(path);
+        const Ordering* ordering = policy.empty() ? nullptr : policy.find(path);
+        const int fd{openat(p.fd, p.name, O_RDONLY | O_DIRECTORY)};
+        if (fd == -1) {
             return -errno;
         }
-        if (config.sort_dirents) {
-            if (config.sort_by_ctime) {
-                auto tmp = create_ctime_dirents_list(dirents, (root + path).c_str());
-                std::sort(tmp.begin(), tmp.end(), compare_ctime_dirents);
-                overwrite_dirents(dirents, tmp);
-            } else {
-                // sort lexicographically
-                std::sort(dirents->begin(), dirents->end());
-            }
-        }
-        if (config.reverse_dirents) {
-            std::reverse(dirents->begin(), dirents->end());
-        }
-        closedir(d);
-        if (errno != 0) {
-            return -errno;
+        std::unique_ptr<Dir_handle> handle;
+        if (const int res = open_dir_handle(fd, ordering ? *ordering : default_ordering(this_mount().config), handle)) {
+            return res;
         }
-        set_fuse_data<Dirents*>(info, dirents.release());
+        set_fuse_data<Dir_handle*>(info, handle.release());
         return 0;
     };
     disorderfs_fuse_operations.readdir = [] (const char* path, void* buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* info) {
-        Dirents&                dirents = *get_fuse_data<Dirents*>(info);
+        Dir_handle&                handle = *get_fuse_data<Dir_handle*>(info);
         struct stat                st;
         memset(&st, 0, sizeof(st));
-        if (config.shuffle_dirents) {
-            std::random_device        rd;
-            std::mt19937              g(rd());
-            std::shuffle(dirents.begin(), dirents.end(), g);
+        if (handle.dir) {
+            // offset is a telldir position, as handed out below
+            if (offset != telldir(handle.dir)) {
+                seekdir(handle.dir, offset);
+            }
+            for (;;) {
+                errno = 0;
+                const struct dirent*        dirent_p = readdir(handle.dir);
+                if (!dirent_p) {
+                    return -errno;
+                }
+                st.st_ino = dirent_p->d_ino;
+                st.st_mode = DTTOIF(dirent_p->d_type);
+                if (filler(buf, dirent_p->d_name, &st, telldir(handle.dir)) != 0) {
+                    return 0;
+                }
+            }
+        }
+        std::shared_ptr<const Dirents> listing;
+        if (const int res = handle_listing(handle, offset, listing)) {
+            return res;
         }
+        const Dirents&                dirents = *listing;
+        const Permutation        shuffled(dirents.size(), handle.shuffle_key);
 
-        for (const auto dirent : dirents) {
-            st.st_ino = dirent.second;
-            if (filler(buf, dirent.first.c_str(), &st, 0) != 0) {
-                return -ENOMEM;
+        // offset is the index of the next entry to return.  When the buffer
+        // fills up, stop; the kernel will come back for the rest.
+        for (size_t i = offset; i < dirents.size(); ++i) {
+            const Dirents::Entry&        entry = dirents[handle.ordering.shuffle ? shuffled(i) : i];
+            st.st_ino = entry.ino;
+            // Passing on the file type saves find and friends from having
+            // to stat every entry just to learn what it is
+            st.st_mode = DTTOIF(entry.type);
+            if (filler(buf, dirents.name(entry), &st, i + 1) != 0) {
+                break;
             }
         }
         return 0;
     };
     disorderfs_fuse_operations.releasedir = [] (const char* path, struct fuse_file_info* info) -> int {
-        delete get_fuse_data<Dirents*>(info);
+        Dir_handle* handle = get_fuse_data<Dir_handle*>(info);
+        listing_budget.remove(*handle);
+        delete handle;
         return 0;
     };
     disorderfs_fuse_operations.fsyncdir = [] (const char* path, int is_datasync, struct fuse_file_info* info) -> int {
+        As_root root;
         // XXX: is it OK to just use fsync?  Not clear on why FUSE has a separate fsyncdir operation
         wrap(is_datasync ? fdatasync(info->fh) : fsync(info->fh));
         return 0; // return value is ignored
     };
     disorderfs_fuse_operations.create = [] (const char* path, mode_t mode, struct fuse_file_info* info) -> int {
         Guard g;
+        const At_path p(path);
         // XXX: use info->flags?
-        const int fd{open((root + path).c_str(), info->flags | O_CREAT, mode)};
+        const int fd{openat(p.fd, p.name, info->flags | O_CREAT, mode)};
+        this_mount().negative_cache.invalidate(path);
         if (fd == -1) {
             return -errno;
         }
@@ -565,26 +5168,32 @@ int        main (int argc, char** argv)
         return 0;
     };
     disorderfs_fuse_operations.ftruncate = [] (const char* path, off_t off, struct fuse_file_info* info) -> int {
+        As_root root;
         return wrap(ftruncate(info->fh, off));
     };
     disorderfs_fuse_operations.fgetattr = [] (const char* path, struct stat* st, struct fuse_file_info* info) -> int {
+        As_root root;
         if (fstat(info->fh, st) == -1) {
             return -errno;
         }
-        st->st_blocks += config.pad_blocks;
+        st->st_blocks += this_mount().config.pad_blocks;
         return 0;
     };
     if (config.share_locks) {
         disorderfs_fuse_operations.lock = [] (const char* path, struct fuse_file_info* info, int cmd, struct flock* lock) -> int {
-            return ulockmgr_op(info->fh, cmd, lock, &info->lock_owner, sizeof(info->lock_owner));
+            // Reopening the file checks the requester's permissions
+            Guard g;
+            return lock_fds.lock(info->fh, info->lock_owner, cmd, lock);
         };
         disorderfs_fuse_operations.flock = [] (const char* path, struct fuse_file_info* info, int op) -> int {
+            As_root root;
             return wrap(flock(info->fh, op));
         };
     }
     disorderfs_fuse_operations.utimens = [] (const char* path, const struct timespec tv[2]) -> int {
         Guard g;
-        return wrap(utimensat(AT_FDCWD, (root + path).c_str(), tv, AT_SYMLINK_NOFOLLOW));
+        const At_path p(path);
+        return wrap(utimensat(p.fd, p.name, tv, AT_SYMLINK_NOFOLLOW));
     };
     /* Not applicable?
     disorderfs_fuse_operations.bmap = [] (const char *, size_t blocksize, uint64_t *idx) -> int {
@@ -598,7 +5207,25 @@ int        main (int argc, char** argv)
     disorderfs_fuse_operations.poll = [] (const char *, struct fuse_file_info *, struct fuse_pollhandle *ph, unsigned *reventsp) -> int {
     };
     */
+    /*
+     * Kernel FUSE passthrough (Linux 6.9+) lets reads and writes on regular
+     * files skip the daemon entirely, but registering a backing file needs
+     * the FUSE 3 API (fuse_passthrough_open), so it is --io=passthrough in
+     * the FUSE 3 backend only.  With libfuse 2, splicing between /dev/fuse
+     * and the backing fd in write_buf/read_buf is as close as we get;
+     * repeated reads can also be served from the page cache with
+     * --cache=relaxed.
+     *
+     * Likewise writeback_cache, which lets the kernel gather small writes in
+     * the page cache and send them on in large batches: libfuse 2 neither
+     * negotiates it nor has a way to ask for it, so it is --io=writeback in
+     * the FUSE 3 backend only.  Here each write(2) stays one request;
+     * --io=throughput at least lets a large one arrive as a single 128 KiB
+     * request rather than 4 KiB pieces.  The write counts in --stats-file
+     * show the difference.
+     */
     disorderfs_fuse_operations.write_buf = [] (const char* path, struct fuse_bufvec* buf, off_t off, struct fuse_file_info* info) -> int {
+        As_root root;
         struct fuse_bufvec dst;
         dst.count = 1;
         dst.idx = 0;
@@ -612,6 +5239,7 @@ int        main (int argc, char** argv)
         return fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
     };
     disorderfs_fuse_operations.read_buf = [] (const char* path, struct fuse_bufvec** bufp, size_t size, off_t off, struct fuse_file_info* info) -> int {
+        As_root root;
         struct fuse_bufvec* src = static_cast<struct fuse_bufvec*>(malloc(sizeof(struct fuse_bufvec)));
         if (src == nullptr) {
             return -ENOMEM;
@@ -631,7 +5259,40 @@ int        main (int argc, char** argv)
         return 0;
     };
     disorderfs_fuse_operations.fallocate = [] (const char* path, int mode, off_t off, off_t len, struct fuse_file_info* info) -> int {
+        As_root root;
         return wrap(fallocate(info->fh, mode, off, len));
     };
-    return fuse_main(fargs.argc, fargs.argv, &disorderfs_fuse_operations, nullptr);
+    /*
+     * copy_file_range and lseek are simple passthroughs on the fh, letting
+     * copies reflink on the underlying filesystem and SEEK_DATA and
+     * SEEK_HOLE find holes, but they only exist in the FUSE 3 API (3.4 and
+     * 3.8), so only the FUSE 3 backend has them.  Under libfuse 2, the
+     * kernel copies through read and write instead (which can at least be
+     * spliced, see --io=throughput), and its generic lseek treats the whole
+     * file as data.
+     */
+    // With probes compiled in, operations are always wrapped, so that
+    // tracers can attach at any time (while timing only what is asked for)
+#ifdef HAVE_SDT
+    const bool instrumented = true;
+#else
+    const bool instrumented = metrics_enabled() || trace_ring.enabled() || recorder.enabled();
+#endif
+    if (instrumented) {
+#define DISORDERFS_INSTRUMENT(name) instrument<OP_##name>(disorderfs_fuse_operations.name);
+        DISORDERFS_OPERATIONS(DISORDERFS_INSTRUMENT)
+#undef DISORDERFS_INSTRUMENT
+    }
+#endif
+    if (metrics_enabled() || trace_ring.enabled()) {
+        // Leave SIGUSR1 and SIGUSR2 to signal_thread, which serve() starts
+        // once it has forked into the background: every other thread
+        // inherits this mask
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGUSR1);
+        sigaddset(&signals, SIGUSR2);
+        pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    }
+    return serve(&fargs, &disorderfs_fuse_operations);
 }